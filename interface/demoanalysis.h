@@ -14,40 +14,42 @@ using namespace nanoflow;
 //These properties cannot be modified after creation for safety.
 class FourMomentumSpherical {
  public:
-  const double _pt, _eta, _phi, _mass;
-  FourMomentumSpherical() : _pt(0.0), _eta(0.0), _phi(0.0), _mass(0.0) {}
-  FourMomentumSpherical(double pt, double eta, double phi, double mass)
-      : _pt(pt), _eta(eta), _phi(phi), _mass(mass) {}
-  inline double pt() const { return _pt; }
+  const PtEtaPhiM _p4;
+  FourMomentumSpherical() : _p4{0.0f, 0.0f, 0.0f, 0.0f} {}
+  FourMomentumSpherical(float pt, float eta, float phi, float mass)
+      : _p4{pt, eta, phi, mass} {}
+  inline float pt() const { return _p4.pt; }
 
-  inline double eta() const { return _eta; }
+  inline float eta() const { return _p4.eta; }
 
-  inline double phi() const { return _phi; }
+  inline float phi() const { return _p4.phi; }
 
-  inline double mass() const { return _mass; }
+  inline float mass() const { return _p4.mass; }
+
+  inline const PtEtaPhiM& p4() const { return _p4; }
+
+  inline PxPyPzE to_cartesian() const { return _p4.to_cartesian(); }
 };
 
 
-// We create a Muon object which has spherical 4-momentum components
-// It also derives from the nanoflow::LazyObject, which allows the
-// muon data to be populated easily from the TTree branches. 
-class Muon : public LazyObject, public FourMomentumSpherical {
+// The muons are stored as a structure of arrays: the four-momentum columns
+// point to the Muon_pt, Muon_eta, ... branches and the user columns below are
+// filled by the analyzers.
+class MuonSchema {
  public:
+  static const char* name() { return "Muon"; }
 
-  //Index of the matched generator muon
-  int matchidx = -1;
-
-  Muon(NanoEvent* _event, unsigned int _index)
-    : LazyObject(_event, _index),
-      FourMomentumSpherical(this->get_float(string_hash("Muon_pt")),
-                            this->get_float(string_hash("Muon_eta")),
-                            this->get_float(string_hash("Muon_phi")),
-                            this->get_float(string_hash("Muon_mass"))),
-      matchidx(-1) {}
+  class Columns {
+   public:
+    //Index of the matched generator muon
+    vector<int> matchidx;
 
-  ~Muon() {}
+    void resize(unsigned int n) { matchidx.assign(n, -1); }
+  };
 };
 
+typedef Collection<MuonSchema> Muons;
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 //                             EVENT STRUCTURE                               //
@@ -66,13 +68,30 @@ class MyAnalysisEvent : public NanoEvent {
   // We need to predefine the event content here
 
   // Physics objects
-  vector<Muon> muons;
+  Muons muons;
+  BranchHandle<Int_t[]> Muon_charge;
+
+  // The generator particles, only valid in simulation
+  BranchHandle<Float_t[]> GenPart_pt;
+  BranchHandle<Float_t[]> GenPart_eta;
+  BranchHandle<Float_t[]> GenPart_phi;
+  BranchHandle<Int_t[]> GenPart_pdgId;
 
   // Simple variables
   int nMuon;
 
   MyAnalysisEvent(TTreeReader& _reader, const Configuration& _config)
-    : NanoEvent(_reader), config(_config) {}
+    : NanoEvent(_reader),
+      config(_config),
+      muons(*this),
+      Muon_charge(handle<Int_t[]>(string_hash("Muon_charge"))) {
+    if (this->has_key(string_hash("GenPart_pt"))) {
+      GenPart_pt = handle<Float_t[]>(string_hash("GenPart_pt"));
+      GenPart_eta = handle<Float_t[]>(string_hash("GenPart_eta"));
+      GenPart_phi = handle<Float_t[]>(string_hash("GenPart_phi"));
+      GenPart_pdgId = handle<Int_t[]>(string_hash("GenPart_pdgId"));
+    }
+  }
 
   // This is very important to make sure that we always start with a clean
   // event and we don't keep any information from previous events
@@ -92,25 +111,38 @@ class MyAnalysisEvent : public NanoEvent {
     const auto run_key = string_hash("run");
     //In older NanoAOD, this was int instead of uint
     //Usually you want to have the datatype fixed, but can choose dynamically as well
-    //as shown here
-    if(this->lc_int.has_key(run_key)) {
-      this->lc_int.read(string_hash("run"));
-      this->run = this->lc_int.get(string_hash("run"));
-    } else if(this->lc_uint.has_key(run_key)) {
-      this->lc_uint.read(string_hash("run"));
-      this->run = this->lc_uint.get(string_hash("run"));
+    //as shown here: get_as converts the branch to the requested type, whatever
+    //the type in the file is
+    if(this->has_key(run_key)) {
+      this->run = this->get_as<unsigned int>(run_key);
     } else {
-      throw std::runtime_error("MyAnalysisEvent::analyze(): Could not find branch 'run' either as int or uint, file is probably not NanoAOD");
+      throw std::runtime_error("MyAnalysisEvent::analyze(): Could not find branch 'run', file is probably not NanoAOD");
     }
  
-    this->lc_uint.read(string_hash("luminosityBlock"));
     this->luminosityBlock = this->lc_uint.get(string_hash("luminosityBlock"));
-    this->lc_ulong64.read(string_hash("event"));
     this->event = this->lc_ulong64.get(string_hash("event"));
   }
 };
 
 
+// This is the columnar representation of a batch of events for looper_batch
+// Here we declare the columns that the batch analyzers need.
+class MyAnalysisBatch : public EventBatch {
+ public:
+  const Configuration& config;
+
+  ValueColumn<UInt_t>& nMuon;
+  ArrayColumn<Float_t>& Muon_pt;
+  ArrayColumn<Float_t>& Muon_eta;
+
+  MyAnalysisBatch(TTreeReader& _reader, const Configuration& _config)
+    : EventBatch(_reader),
+      config(_config),
+      nMuon(add_value<UInt_t>("nMuon")),
+      Muon_pt(add_array<Float_t>("Muon_pt")),
+      Muon_eta(add_array<Float_t>("Muon_eta")) {}
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 //                                ANALYZERS                                  //
@@ -121,34 +153,159 @@ class MyAnalysisEvent : public NanoEvent {
 class MuonEventAnalyzer : public Analyzer {
  public:
   Output& output;
+  Histogram1D& h_muon_pt;
 
-  MuonEventAnalyzer(Output& _output) : output(_output) {
+  MuonEventAnalyzer(Output& _output)
+      : output(_output),
+        h_muon_pt(output.add_histogram_1d("muon_pt", Axis(100, 0, 200))) {
     cout << "Creating MuonEventAnalyzer" << endl;
   }
 
   virtual void analyze(NanoEvent& _event) override {
     auto& event = static_cast<MyAnalysisEvent&>(_event);
 
-    // Read the necessary branches from disk
-    event.lc_uint.read(string_hash("nMuon"));
-    event.lc_vfloat.read(string_hash("Muon_pt"));
-    event.lc_vfloat.read(string_hash("Muon_eta"));
-    event.lc_vfloat.read(string_hash("Muon_phi"));
-    event.lc_vfloat.read(string_hash("Muon_mass"));
-
-    // Construct muon objects from the branches and put them to the event
-    const auto nMuon = event.lc_uint.get(string_hash("nMuon"));
-    for (unsigned int _nMuon = 0; _nMuon < nMuon; _nMuon++) {
-      Muon muon(&event, _nMuon);
-      event.muons.push_back(muon);
-    }
+    // Point the muon columns to the branches, which are read from disk on
+    // first access
+    event.muons.read();
+    event.nMuon = static_cast<int>(event.muons.size());
+
+    // Fill all the muons of the event at once
+    h_muon_pt.fill_batch(event.muons.pt.data(), nullptr, event.muons.size());
   }
 
   virtual const string getName() const override { return "MuonEventAnalyzer"; }
 
+  virtual Analyzer* clone(Output& output) const override {
+    return new MuonEventAnalyzer(output);
+  }
+
+};
+
+
+//Matches the muons to the generator muons by deltaR, filling
+//muons.columns.matchidx with the index of the matched GenPart. In data, the
+//muons stay unmatched.
+class MuonGenMatchAnalyzer : public Analyzer {
+ public:
+  DeltaRMatcher matcher;
+
+  // The generator muons of the event, reused in every event
+  vector<float> gen_pt;
+  vector<float> gen_eta;
+  vector<float> gen_phi;
+  vector<int> gen_index;
+  vector<int> matchidx;
+
+  // A muon is only matched to a generator muon within max_dr whose pt differs
+  // by less than max_pt_rel_diff * the generator pt, see DeltaRMatcher
+  MuonGenMatchAnalyzer(float max_dr = 0.3f, float max_pt_rel_diff = 0.5f,
+                       DeltaRMatcher::Algorithm algorithm = DeltaRMatcher::Algorithm::Optimal)
+      : matcher(max_dr, algorithm, max_pt_rel_diff) {
+    cout << "Creating MuonGenMatchAnalyzer" << endl;
+  }
+
+  virtual void analyze(NanoEvent& _event) override {
+    auto& event = static_cast<MyAnalysisEvent&>(_event);
+    if (!event.GenPart_pt.valid()) {
+      return;
+    }
+
+    gen_pt.clear();
+    gen_eta.clear();
+    gen_phi.clear();
+    gen_index.clear();
+    const auto pdg_id = event.GenPart_pdgId.get_vec();
+    for (unsigned int i = 0; i < pdg_id.size(); i++) {
+      if (std::abs(pdg_id[i]) == 13) {
+        gen_pt.push_back(event.GenPart_pt[i]);
+        gen_eta.push_back(event.GenPart_eta[i]);
+        gen_phi.push_back(event.GenPart_phi[i]);
+        gen_index.push_back(static_cast<int>(i));
+      }
+    }
+
+    const auto& muons = event.muons;
+    matchidx.resize(muons.size());
+    matcher.match(muons.pt.data(), muons.eta.data(), muons.phi.data(), muons.size(),
+                  gen_pt.data(), gen_eta.data(), gen_phi.data(), gen_pt.size(),
+                  matchidx.data());
+    for (unsigned int i = 0; i < muons.size(); i++) {
+      event.muons.columns.matchidx[i] = matchidx[i] >= 0 ? gen_index[matchidx[i]] : -1;
+    }
+  }
+
+  virtual const string getName() const override { return "MuonGenMatchAnalyzer"; }
+
+  virtual Analyzer* clone(Output& output) const override {
+    return new MuonGenMatchAnalyzer(matcher.max_dr, matcher.max_pt_rel_diff, matcher.algorithm);
+  }
 };
 
 
+//Keeps only the events with at least min_muons muons, such that the following
+//analyzers do not need to process (and read the branches of) the other events
+class MuonFilterAnalyzer : public FilterAnalyzer {
+ public:
+  int min_muons;
+
+  MuonFilterAnalyzer(int _min_muons = 1) : min_muons(_min_muons) {
+    cout << "Creating MuonFilterAnalyzer" << endl;
+  }
+
+  virtual bool filter(NanoEvent& _event) override {
+    auto& event = static_cast<MyAnalysisEvent&>(_event);
+    return event.nMuon >= min_muons;
+  }
+
+  virtual const string getName() const override { return "MuonFilterAnalyzer"; }
+
+  virtual Analyzer* clone(Output& output) const override {
+    return new MuonFilterAnalyzer(min_muons);
+  }
+};
+
+
+//Counts the muons in the central region in a batched loop
+class MuonBatchAnalyzer : public Analyzer {
+ public:
+  Output& output;
+
+  unsigned long long num_central_muons;
+  Histogram1D& h_muon_pt;
+
+  MuonBatchAnalyzer(Output& _output)
+      : output(_output),
+        num_central_muons(0),
+        h_muon_pt(output.add_histogram_1d("batch_muon_pt", Axis(100, 0, 200))) {
+    cout << "Creating MuonBatchAnalyzer" << endl;
+  }
+
+  virtual void analyze(NanoEvent& _event) override {
+    throw std::runtime_error("MuonBatchAnalyzer can only be used in looper_batch");
+  }
+
+  virtual void analyze_batch(EventBatch& _batch) override {
+    auto& batch = static_cast<MyAnalysisBatch&>(_batch);
+
+    // The muons of all events in the batch are stored contiguously, so we
+    // can select them with vectorized kernels
+    const auto central = compare(batch.Muon_eta, simd::Cmp::Less, 1.5, true);
+    const auto counts = segmented_count(batch.Muon_eta, central);
+    for (unsigned int iev = 0; iev < counts.size(); iev++) {
+      num_central_muons += counts[iev];
+    }
+
+    // The muons of the whole batch are filled in one call
+    h_muon_pt.fill_batch(batch.Muon_pt.content, nullptr, batch.Muon_pt.content_size);
+  }
+
+  virtual const string getName() const override { return "MuonBatchAnalyzer"; }
+
+  virtual Analyzer* clone(Output& output) const override {
+    return new MuonBatchAnalyzer(output);
+  }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //                           
 //                               OUTPUT TREE                                 //
@@ -162,53 +319,70 @@ class MyTreeAnalyzer : public TreeAnalyzer {
   int nMuon_match;
 
   int nMuon;
-  const static unsigned int nMuon_MAX = 20; 
-  array<float, nMuon_MAX> Muon_px;
-  array<float, nMuon_MAX> Muon_py;
-  array<float, nMuon_MAX> Muon_pz;
-  array<float, nMuon_MAX> Muon_energy;
-  array<int, nMuon_MAX> Muon_matchidx;
+  OutputColumn<float> Muon_px;
+  OutputColumn<float> Muon_py;
+  OutputColumn<float> Muon_pz;
+  OutputColumn<float> Muon_energy;
+  OutputColumn<int> Muon_matchidx;
+
+  // Buffers for the muon pairs, reused in every event
+  CombinationInput muon_input;
+  Combinations muon_pairs;
 
   MyTreeAnalyzer(Output& _output) : TreeAnalyzer(_output) {
 
-    out_tree->Branch("nMuon", &nMuon, "nMuon/I");
-    out_tree->Branch("Muon_px", Muon_px.data(), "Muon_px[nMuon]/F");
-    out_tree->Branch("Muon_py", Muon_py.data(), "Muon_py[nMuon]/F");
-    out_tree->Branch("Muon_pz", Muon_pz.data(), "Muon_pz[nMuon]/F");
-    out_tree->Branch("Muon_energy", Muon_energy.data(), "Muon_energy[nMuon]/F");
-    out_tree->Branch("Muon_matchidx", Muon_matchidx.data(),
-                     "Muon_matchidx[nMuon]/I");
+    branch("lep2_highest_inv_mass", &lep2_highest_inv_mass, "lep2_highest_inv_mass/F");
+    branch("nMuon_match", &nMuon_match, "nMuon_match/I");
+    branch("nMuon", &nMuon, "nMuon/I");
+    branch("Muon_px", Muon_px, "Muon_px[nMuon]/F");
+    branch("Muon_py", Muon_py, "Muon_py[nMuon]/F");
+    branch("Muon_pz", Muon_pz, "Muon_pz[nMuon]/F");
+    branch("Muon_energy", Muon_energy, "Muon_energy[nMuon]/F");
+    branch("Muon_matchidx", Muon_matchidx, "Muon_matchidx[nMuon]/I");
   }
 
   virtual const string getName() const override { return "MyTreeAnalyzer"; }
 
-  void clear() {
-    nMuon = 0;
+  virtual Analyzer* clone(Output& output) const override {
+    return new MyTreeAnalyzer(output);
+  }
 
+  void clear() {
+    lep2_highest_inv_mass = 0.0f;
+    nMuon_match = 0;
     nMuon = 0;
-    Muon_px.fill(0.0);
-    Muon_py.fill(0.0);
-    Muon_pz.fill(0.0);
-    Muon_energy.fill(0.0);
-    Muon_matchidx.fill(0);
   }
 
-  void fill_muon(MyAnalysisEvent& event, vector<Muon>& src) {
-    nMuon = static_cast<int>(src.size());
+  void fill_muon(MyAnalysisEvent& event, const Muons& src) {
+    const unsigned int n = src.size();
+    nMuon = static_cast<int>(n);
+    Muon_px.resize(n);
+    Muon_py.resize(n);
+    Muon_pz.resize(n);
+    Muon_energy.resize(n);
+    Muon_matchidx.resize(n);
+
+    // Convert the columns in one loop, without going through TLorentzVector.
+    // The fast math functions are accurate to a few ULP, which is plenty for
+    // the output tree.
+    to_cartesian(src.pt.data(), src.eta.data(), src.phi.data(), src.mass.data(), n,
+                 Muon_px.data(), Muon_py.data(), Muon_pz.data(), Muon_energy.data(),
+                 simd::MathMode::Fast);
+    std::copy(src.columns.matchidx.begin(), src.columns.matchidx.begin() + n,
+              Muon_matchidx.data());
+    nMuon_match = static_cast<int>(std::count_if(src.columns.matchidx.begin(),
+                                                 src.columns.matchidx.begin() + n,
+                                                 [](int idx) { return idx >= 0; }));
+  }
 
-    unsigned int i = 0;
-    for (auto& gp : src) {
-      if (i >= Muon_px.size()) {
-        cerr << "ERROR: fill_muon, Muon out of range: " << src.size() << ">=" << Muon_px.size() << " event " << event.event << ", dropping muons over " << Muon_px.size() << endl;
-        break;
-      }
-      const auto lv = make_lv(gp.pt(), gp.eta(), gp.phi(), gp.mass());
-      Muon_px[i] = static_cast<float>(lv.Px());
-      Muon_py[i] = static_cast<float>(lv.Py());
-      Muon_pz[i] = static_cast<float>(lv.Pz());
-      Muon_energy[i] = static_cast<float>(lv.Energy());
-      Muon_matchidx[i] = src.at(i).matchidx;
-      i += 1;
+  // The highest invariant mass of the opposite-charge muon pairs
+  void fill_dimuon(MyAnalysisEvent& event) {
+    muon_input.clear();
+    muon_input.add(event.muons, event.Muon_charge.get_vec().data(), 13);
+    make_pairs(muon_input, PairConstraint{true, false}, muon_pairs);
+    const int best = muon_pairs.best([&](unsigned int ic) { return muon_pairs.mass[ic]; });
+    if (best >= 0) {
+      lep2_highest_inv_mass = muon_pairs.mass[best];
     }
   }
 
@@ -219,6 +393,7 @@ class MyTreeAnalyzer : public TreeAnalyzer {
     nMuon = event.nMuon;
 
     fill_muon(event, event.muons);
+    fill_dimuon(event);
 
     TreeAnalyzer::analyze(event);
   }
@@ -230,3 +405,15 @@ static inline FileReport looper_main_demoanalysis(const Configuration& config,
                        const vector<Analyzer*>& analyzers) {
   return looper_main<MyAnalysisEvent, Configuration>(config, reader, output, analyzers);
 };
+
+static inline FileReport looper_main_mt_demoanalysis(const Configuration& config,
+                       const string& filename, Output& output,
+                       const vector<Analyzer*>& analyzers) {
+  return looper_main_mt<MyAnalysisEvent, Configuration>(config, filename, output, analyzers);
+};
+
+static inline FileReport looper_batch_demoanalysis(const Configuration& config,
+                       TTreeReader& reader, Output& output,
+                       const vector<Analyzer*>& analyzers) {
+  return looper_batch<MyAnalysisBatch, Configuration>(config, reader, output, analyzers);
+};
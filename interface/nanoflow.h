@@ -4,12 +4,16 @@
 #include <chrono>
 #include <iomanip>
 
+#include <TEnv.h>
 #include <TFile.h>
 #include <TH1D.h>
+#include <TH2D.h>
+#include <TROOT.h>
 #include <TStopwatch.h>
 #include <TLorentzVector.h>
 
 #include "json.hpp"
+#include "nanoflow_simd.h"
 
 using namespace std;
 using nlohmann::json;
@@ -20,7 +24,21 @@ using nlohmann::json;
 #include <TTreeReaderValue.h>
 #include <ROOT/RDataFrame.hxx>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <tuple>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
 #include <typeinfo>
+#include <utility>
 
 using namespace std;
 
@@ -42,6 +60,39 @@ class Configuration {
   int max_events;
   int report_period;
 
+  // The number of events per batch in looper_batch, 0 to use the TTree
+  // clusters as batches
+  int batch_size;
+
+  // The number of events from which to learn the used branches, after which
+  // all the other branches are disabled, 0 to disable branch pruning
+  int branch_learn_events;
+
+  // The number of threads in looper_main_mt and looper_files_mt
+  int num_threads;
+
+  // The approximate number of entries per task in looper_main_mt and
+  // looper_files_mt. The tasks do not depend on the number of threads, such
+  // that the histograms are the same for any number of threads.
+  long long task_entries;
+
+  // The size of the TTreeCache in bytes and the number of entries from which
+  // it learns the used branches, 0 to keep the ROOT defaults
+  long long cache_size;
+  int cache_learn_entries;
+
+  // Reads and decompresses the input data in background threads while the
+  // events are analyzed, see enable_async_prefetch and looper_batch
+  bool prefetch;
+
+  // The number of events that are buffered for the TTree writer thread, see
+  // AsyncTreeWriter. 0 fills the output TTrees in the event loop.
+  int async_output;
+
+  // The number of ROOT implicit multithreading threads, e.g. to compress the
+  // output baskets in parallel with async_output, 0 to disable
+  int imt_threads;
+
   //Populate the Configuration from json
   Configuration(const string& json_file) {
     ifstream inp(json_file);
@@ -54,98 +105,588 @@ class Configuration {
     output_filename = input_json.at("output_filename").get<string>();
     max_events = input_json.at("max_events").get<int>();
     report_period = input_json.at("report_period").get<int>();
+    branch_learn_events = input_json.value("branch_learn_events", 0);
+    batch_size = input_json.value("batch_size", 0);
+    num_threads = input_json.value("num_threads", 1);
+    task_entries = input_json.value("task_entries", 100000ll);
+    cache_size = input_json.value("cache_size", 0ll);
+    cache_learn_entries = input_json.value("cache_learn_entries", 0);
+    prefetch = input_json.value("prefetch", false);
+    async_output = input_json.value("async_output", 0);
+    imt_threads = input_json.value("imt_threads", 0);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                                 PHYSICS                                   //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// Lightweight four-vectors in single precision. Unlike TLorentzVector, these
+// are plain structs of four floats without a virtual base, so they can be
+// kept in arrays, passed in registers and used in vectorized loops. The
+// conventions follow TLorentzVector, e.g. mass() is negative for spacelike
+// vectors.
+
+class PxPyPzE;
+
+// A three-vector, e.g. the velocity of a boost
+class ThreeVector {
+ public:
+  float x;
+  float y;
+  float z;
+
+  inline ThreeVector operator-() const { return ThreeVector{-x, -y, -z}; }
+  inline float mag2() const { return x * x + y * y + z * z; }
+  inline float mag() const { return std::sqrt(mag2()); }
+};
+
+// A four-vector in the coordinates of NanoAOD
+class PtEtaPhiM {
+ public:
+  float pt;
+  float eta;
+  float phi;
+  float mass;
+
+  inline float px() const { return pt * std::cos(phi); }
+  inline float py() const { return pt * std::sin(phi); }
+  inline float pz() const { return pt * std::sinh(eta); }
+  inline float p() const { return pt * std::cosh(eta); }
+  inline float energy() const {
+    const float pp = p();
+    return std::sqrt(pp * pp + mass * mass);
+  }
+
+  inline PxPyPzE to_cartesian() const;
+};
+
+// A four-vector in cartesian coordinates, used to add vectors and to boost
+class PxPyPzE {
+ public:
+  float px;
+  float py;
+  float pz;
+  float e;
+
+  inline PxPyPzE& operator+=(const PxPyPzE& other) {
+    px += other.px;
+    py += other.py;
+    pz += other.pz;
+    e += other.e;
+    return *this;
+  }
+
+  inline PxPyPzE& operator-=(const PxPyPzE& other) {
+    px -= other.px;
+    py -= other.py;
+    pz -= other.pz;
+    e -= other.e;
+    return *this;
+  }
+
+  inline PxPyPzE operator+(const PxPyPzE& other) const {
+    PxPyPzE ret = *this;
+    return ret += other;
+  }
+
+  inline PxPyPzE operator-(const PxPyPzE& other) const {
+    PxPyPzE ret = *this;
+    return ret -= other;
+  }
+
+  inline float pt2() const { return px * px + py * py; }
+  inline float pt() const { return std::sqrt(pt2()); }
+  inline float p2() const { return pt2() + pz * pz; }
+  inline float p() const { return std::sqrt(p2()); }
+  inline float mass2() const { return e * e - p2(); }
+
+  inline float mass() const {
+    const float m2 = mass2();
+    return m2 < 0.0f ? -std::sqrt(-m2) : std::sqrt(m2);
+  }
+
+  inline float phi() const { return (px == 0.0f && py == 0.0f) ? 0.0f : std::atan2(py, px); }
+
+  // The pseudorapidity, +-1e10 along the beam axis as in TLorentzVector
+  inline float eta() const {
+    const float ptv = pt();
+    if (ptv == 0.0f) {
+      return pz == 0.0f ? 0.0f : std::copysign(1e10f, pz);
+    }
+    return std::asinh(pz / ptv);
+  }
+
+  inline PtEtaPhiM to_spherical() const { return PtEtaPhiM{pt(), eta(), phi(), mass()}; }
+
+  // The velocity of the rest frame, boost(-v.boost_vector()) gives the vector
+  // in its own rest frame
+  inline ThreeVector boost_vector() const { return ThreeVector{px / e, py / e, pz / e}; }
+
+  // Applies the Lorentz boost with velocity b, |b| < 1
+  inline PxPyPzE boost(const ThreeVector& b) const {
+    const float b2 = b.mag2();
+    const float gamma = 1.0f / std::sqrt(1.0f - b2);
+    const float bp = b.x * px + b.y * py + b.z * pz;
+    const float gamma2 = b2 > 0.0f ? (gamma - 1.0f) / b2 : 0.0f;
+    return PxPyPzE{px + gamma2 * bp * b.x + gamma * b.x * e,
+                   py + gamma2 * bp * b.y + gamma * b.y * e,
+                   pz + gamma2 * bp * b.z + gamma * b.z * e,
+                   gamma * (e + bp)};
   }
 };
 
+inline PxPyPzE PtEtaPhiM::to_cartesian() const {
+  const float pzv = pz();
+  return PxPyPzE{px(), py(), pzv, std::sqrt(pt * pt + pzv * pzv + mass * mass)};
+}
+
+inline PxPyPzE operator+(const PtEtaPhiM& a, const PtEtaPhiM& b) {
+  return a.to_cartesian() + b.to_cartesian();
+}
+
+// The difference of two angles in [-pi, pi]
+static inline float delta_phi(float phi1, float phi2) {
+  const float pi = static_cast<float>(M_PI);
+  float dphi = phi1 - phi2;
+  if (dphi > pi || dphi < -pi) {
+    dphi = std::remainder(dphi, 2.0f * pi);
+  }
+  return dphi;
+}
+
+static inline float delta_r2(float eta1, float phi1, float eta2, float phi2) {
+  const float deta = eta1 - eta2;
+  const float dphi = delta_phi(phi1, phi2);
+  return deta * deta + dphi * dphi;
+}
+
+static inline float delta_r(float eta1, float phi1, float eta2, float phi2) {
+  return std::sqrt(delta_r2(eta1, phi1, eta2, phi2));
+}
+
+static inline float delta_r(const PtEtaPhiM& a, const PtEtaPhiM& b) {
+  return delta_r(a.eta, a.phi, b.eta, b.phi);
+}
+
+// The invariant mass of a pair of objects
+static inline float invariant_mass(const PtEtaPhiM& a, const PtEtaPhiM& b) {
+  return (a + b).mass();
+}
+
+// The second step of to_cartesian with MathMode::Fast: px, py and pz hold
+// cos(phi), sin(phi) and sinh(eta) and are scaled by pt in place. The
+// __restrict parameters let the compiler vectorize the loop.
+static inline void scale_to_cartesian(const float* __restrict pt, const float* __restrict mass,
+                                      size_t n, float* __restrict px, float* __restrict py,
+                                      float* __restrict pz, float* __restrict e) {
+  for (size_t i = 0; i < n; i++) {
+    px[i] *= pt[i];
+    py[i] *= pt[i];
+    pz[i] *= pt[i];
+    e[i] = pt[i] * pt[i] + pz[i] * pz[i] + mass[i] * mass[i];
+  }
+}
+
+// Converts n four-vectors stored as structure-of-arrays columns, e.g. the
+// Muon_pt, Muon_eta, ... branches, to cartesian columns. With the default
+// MathMode::Exact, every element calls libm sin, cos and sinh, so the loop is
+// not vectorized. With MathMode::Fast, the trigonometric functions are
+// computed with the vectorized approximations of nanoflow_simd.h, using the
+// output columns as scratch space, and the remaining loop is vectorized too.
+// The output columns must not overlap the input columns.
+static inline void to_cartesian(const float* pt, const float* eta, const float* phi,
+                                const float* mass, size_t n, float* px, float* py,
+                                float* pz, float* e,
+                                simd::MathMode mode = simd::MathMode::Exact) {
+  if (mode == simd::MathMode::Fast) {
+    simd::sincos(phi, n, py, px, mode);
+    simd::sinh(eta, n, pz, mode);
+    scale_to_cartesian(pt, mass, n, px, py, pz, e);
+    simd::sqrt(e, n, e, mode);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    const float pzi = pt[i] * std::sinh(eta[i]);
+    px[i] = pt[i] * std::cos(phi[i]);
+    py[i] = pt[i] * std::sin(phi[i]);
+    pz[i] = pzi;
+    e[i] = std::sqrt(pt[i] * pt[i] + pzi * pzi + mass[i] * mass[i]);
+  }
+}
+
+// Converts n cartesian four-vectors to the NanoAOD coordinates
+static inline void to_spherical(const float* px, const float* py, const float* pz,
+                                const float* e, size_t n, float* pt, float* eta,
+                                float* phi, float* mass) {
+  for (size_t i = 0; i < n; i++) {
+    const auto v = PxPyPzE{px[i], py[i], pz[i], e[i]}.to_spherical();
+    pt[i] = v.pt;
+    eta[i] = v.eta;
+    phi[i] = v.phi;
+    mass[i] = v.mass;
+  }
+}
+
+static_assert(std::is_pod<PtEtaPhiM>::value && std::is_pod<PxPyPzE>::value,
+              "the four-vectors need to be plain structs");
+
+// The sum of n four-vectors given as structure-of-arrays columns
+static inline PxPyPzE sum_p4(const float* pt, const float* eta, const float* phi,
+                             const float* mass, size_t n) {
+  PxPyPzE sum{0.0f, 0.0f, 0.0f, 0.0f};
+  for (size_t i = 0; i < n; i++) {
+    sum += PtEtaPhiM{pt[i], eta[i], phi[i], mass[i]}.to_cartesian();
+  }
+  return sum;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 //                               DATA ACCESS                                 //
 //                                                                           // 
 ///////////////////////////////////////////////////////////////////////////////
 
-// Compile-time hash function for strings from
-// https://github.com/rioki/rex/blob/master/strex.h#L95  By defining this, we
+// The key of a branch, histogram or tree, computed from its name
+typedef unsigned long long HashKey;
+
+// Compile-time 64-bit FNV-1a hash function for strings. By defining this, we
 // can access members from the map by a string that is known at compile time
 // without having to do runtime string hashing, meaning the code can be fast.
-constexpr inline unsigned int string_hash(const char* str, int h = 0) {
-  return !str[h] ? 5381 : (string_hash(str, h + 1) * 33) ^ str[h];
+// With 64 bits, a collision among the ~1000 branches of a NanoAOD file is
+// very unlikely, but NanoEvent still checks for it when it is constructed.
+constexpr inline HashKey string_hash64(const char* str,
+                                       HashKey h = 14695981039346656037ULL) {
+  return !*str ? h
+               : string_hash64(str + 1, (h ^ static_cast<unsigned char>(*str)) *
+                                            1099511628211ULL);
+}
+
+constexpr inline HashKey string_hash(const char* str) {
+  return string_hash64(str);
 }
 
-inline unsigned int string_hash_cpp(const string& str) {
-  return string_hash(str.c_str());
+inline HashKey string_hash_cpp(const string& str) {
+  return string_hash64(str.c_str());
 }
 
+// Non-owning view of a contiguous array, e.g. the buffer of a
+// TTreeReaderArray. Creating or copying a view never allocates. The view is
+// only valid as long as the underlying buffer is, for branch data this means
+// until the next call to reader.Next().
+template <typename T>
+class ArrayView {
+ public:
+  const T* ptr;
+  size_t n;
+
+  ArrayView() : ptr(nullptr), n(0) {}
+  ArrayView(const T* _ptr, size_t _n) : ptr(_ptr), n(_n) {}
+
+  inline size_t size() const { return n; }
+  inline bool empty() const { return n == 0; }
+  inline const T* data() const { return ptr; }
+  inline const T* begin() const { return ptr; }
+  inline const T* end() const { return ptr + n; }
+  inline const T& operator[](size_t idx) const { return ptr[idx]; }
+
+  inline const T& at(size_t idx) const {
+    if (idx >= n) {
+      throw std::out_of_range("ArrayView::at(): index out of range");
+    }
+    return ptr[idx];
+  }
+
+  // Copies the data to an owning RVec, which stays valid after reader.Next()
+  ROOT::VecOps::RVec<T> to_rvec() const {
+    return ROOT::VecOps::RVec<T>(begin(), end());
+  }
+
+  // Allows existing code that expects an RVec to keep working, at the cost
+  // of a copy
+  operator ROOT::VecOps::RVec<T>() const { return to_rvec(); }
+};
+
+// How LazyArrayReader makes the branch data available after read()
+//  View: the ArrayView points directly to the TTreeReaderArray buffer, no
+//        copies are made, but the data is invalidated by reader.Next()
+//  Copy: the data is copied to an RVec owned by the LazyArrayReader, which
+//        stays valid until the branch is read again
+enum class ArrayReadMode { View, Copy };
+
+// The bookkeeping that is common to all branches: the generation of the
+// event the data was loaded in and whether the branch was used at all, which
+// is needed to prune unused branches (see NanoEvent::prune_branches).
+class BranchSlot {
+ public:
+  TTreeReader& reader;
+  const string name;
+  // the name of the branch that holds the length of an array, empty for values
+  const string count_name;
+  // the generation of the current event and the one the data was loaded in
+  const unsigned long long& generation;
+  unsigned long long loaded_generation;
+  // true if the branch was read at least once
+  bool used;
+  // true if the branch was disabled in the TTree
+  bool pruned;
+
+  BranchSlot(TTreeReader& _reader, const string& _name,
+             const string& _count_name, const unsigned long long& _generation)
+      : reader(_reader),
+        name(_name),
+        count_name(_count_name),
+        generation(_generation),
+        loaded_generation(0),
+        used(false),
+        pruned(false) {}
+
+  // Called on the first read of the branch
+  void mark_used() {
+    used = true;
+    // The branch was pruned, but it is needed after all, so we enable it again
+    if (pruned) {
+      cout << "Branch " << name << " was disabled, but it was accessed, enabling it again" << endl;
+      auto* tree = reader.GetTree();
+      tree->SetBranchStatus(name.c_str(), 1);
+      tree->AddBranchToCache(name.c_str(), true);
+      if (!count_name.empty()) {
+        tree->SetBranchStatus(count_name.c_str(), 1);
+        tree->AddBranchToCache(count_name.c_str(), true);
+      }
+      pruned = false;
+    }
+  }
+};
+
+// The state of one array branch: the TTreeReaderArray and the data that
+// was read from it for the current event
+template <typename T>
+class ArraySlot : public BranchSlot {
+ public:
+  unique_ptr<TTreeReaderArray<T>> branch;
+  // view of the data that was read for the current event
+  ArrayView<T> view;
+  // memory-contiguous copy of the array, only used in ArrayReadMode::Copy
+  ROOT::VecOps::RVec<T> copy;
+  // the read mode of the LazyArrayReader that owns this slot
+  const ArrayReadMode& read_mode;
+
+  ArraySlot(TTreeReader& _reader, const string& id, const string& count_id,
+            const ArrayReadMode& _read_mode,
+            const unsigned long long& _generation)
+      : BranchSlot(_reader, id, count_id, _generation),
+        branch(make_unique<TTreeReaderArray<T>>(_reader, id.c_str())),
+        read_mode(_read_mode) {}
+
+  // Loads the data for the current event, unless it was already loaded
+  inline void read() {
+    if (loaded_generation != generation) {
+      load();
+    }
+  }
+
+  inline const ArrayView<T>& get_view() {
+    read();
+    return view;
+  }
+
+  void load() {
+    if (!used) {
+      mark_used();
+    }
+    loaded_generation = generation;
+    auto& branch_val = *branch;
+    const size_t n = branch_val.GetSize();
+
+    // The buffer of a TTreeReaderArray is contiguous for the simple arrays in
+    // NanoAOD, but we check it to be safe and fall back to a copy otherwise.
+    const bool contiguous =
+        n == 0 || &branch_val.At(n - 1) == &branch_val.At(0) + (n - 1);
+
+    if (read_mode == ArrayReadMode::View && contiguous) {
+      view = ArrayView<T>(n > 0 ? &branch_val.At(0) : nullptr, n);
+    } else {
+      copy = ROOT::VecOps::RVec<T>(branch_val.begin(), branch_val.end());
+      view = ArrayView<T>(copy.data(), copy.size());
+    }
+  }
+};
+
+// The state of one value branch
+template <typename T>
+class ValueSlot : public BranchSlot {
+ public:
+  unique_ptr<TTreeReaderValue<T>> branch;
+  T value;
+
+  ValueSlot(TTreeReader& _reader, const string& id,
+            const unsigned long long& _generation)
+      : BranchSlot(_reader, id, "", _generation),
+        branch(make_unique<TTreeReaderValue<T>>(_reader, id.c_str())),
+        value() {}
+
+  // Loads the value for the current event, unless it was already loaded
+  inline void read() {
+    if (loaded_generation != generation) {
+      load();
+    }
+  }
+
+  inline T get_value() {
+    read();
+    return value;
+  }
+
+  void load() {
+    if (!used) {
+      mark_used();
+    }
+    loaded_generation = generation;
+    value = **branch;
+  }
+};
+
+// A handle to a branch that was resolved once, e.g. when constructing the
+// event, such that the per-event access is a pointer dereference instead of
+// a hash map lookup. Like the readers, handles load the data on first access
+// in each event. BranchHandle<T> refers to a value branch (e.g. nMuon),
+// BranchHandle<T[]> to an array branch (e.g. Muon_pt[nMuon]).
+// Handles are obtained from LazyValueReader::handle and
+// LazyArrayReader::handle and are valid as long as the NanoEvent is.
+template <typename T>
+class BranchHandle {
+ public:
+  ValueSlot<T>* slot;
+
+  BranchHandle() : slot(nullptr) {}
+  explicit BranchHandle(ValueSlot<T>* _slot) : slot(_slot) {}
+
+  inline bool valid() const { return slot != nullptr; }
+
+  // Reads the value of the current event, this is optional as get() will
+  // read the value on demand
+  inline void read() const { slot->read(); }
+
+  inline T get() const { return slot->get_value(); }
+  inline T operator*() const { return slot->get_value(); }
+};
+
+template <typename T>
+class BranchHandle<T[]> {
+ public:
+  ArraySlot<T>* slot;
+
+  BranchHandle() : slot(nullptr) {}
+  explicit BranchHandle(ArraySlot<T>* _slot) : slot(_slot) {}
+
+  inline bool valid() const { return slot != nullptr; }
+
+  // Reads the array of the current event, this is optional as the accessors
+  // read the array on demand
+  inline void read() const { slot->read(); }
+
+  inline size_t size() const { return slot->get_view().size(); }
+  inline T get(unsigned int idx) const { return slot->get_view()[idx]; }
+  inline T operator[](unsigned int idx) const { return slot->get_view()[idx]; }
+  inline ArrayView<T> get_vec() const { return slot->get_view(); }
+};
+
 // Wraps arrays of a specific type from a TTree to TTreeReaderArray-s
+// The arrays are read from the TTree on demand the first time they are
+// accessed in an event (as counted by the event generation), and served from
+// memory after that.
 template <typename T>
 class LazyArrayReader {
  public:
   TTreeReader& reader;
 
-  unordered_map<unsigned int, unique_ptr<TTreeReaderArray<T>>> reader_cache;
-  // memory-contiguous data from the arrays
-  unordered_map<unsigned int, ROOT::VecOps::RVec<T>> value_cache;
+  ArrayReadMode read_mode;
+
+  // The generation number of the current event, owned by the NanoEvent
+  const unsigned long long& generation;
 
-  LazyArrayReader(TTreeReader& _reader) : reader(_reader) {}
+  // The branches are stored densely, such that BranchHandles can point
+  // straight to them. A deque keeps the slots in place when more are added.
+  deque<ArraySlot<T>> slots;
+  // Maps the branch name hash to the index in slots
+  unordered_map<HashKey, unsigned int> slot_index;
+
+  LazyArrayReader(TTreeReader& _reader, const unsigned long long& _generation)
+      : reader(_reader),
+        read_mode(ArrayReadMode::View),
+        generation(_generation) {}
 
   // Creates the TTreeReaderArray for a specific branch on the heap and stores
-  // it in the cache
-  void setup(const string& id) {
+  // it in the cache. count_id is the name of the branch with the array length.
+  void setup(const string& id, const string& count_id = "") {
     // const char* tn =
     //     static_cast<TLeaf*>(
     //         reader.GetTree()->GetBranch(id.c_str())->GetListOfLeaves()->At(0))
     //         ->GetTypeName();
     // cout << "Branch: vector " << tn << " " << id << endl;
     const auto id_hash = string_hash_cpp(id);
-    if (reader_cache.find(id_hash) == reader_cache.end()) {
-      reader_cache[id_hash] =
-          make_unique<TTreeReaderArray<T>>(reader, id.c_str());
+    const auto it = slot_index.find(id_hash);
+    if (it == slot_index.end()) {
+      slot_index[id_hash] = slots.size();
+      slots.emplace_back(reader, id, count_id, read_mode, generation);
+    } else if (slots[it->second].name != id) {
+      throw std::runtime_error("LazyArrayReader::setup(): branch names " + slots[it->second].name + " and " + id + " have the same hash");
     }
   }
 
-  void read(const unsigned int& id_hash) {
-    if (reader_cache.find(id_hash) != reader_cache.end()) {
-      const auto& branch_val = *reader_cache.at(id_hash);
-
-      value_cache[id_hash] = ROOT::VecOps::RVec<T>(branch_val.begin(), branch_val.end());
-    } else {
-      throw std::runtime_error("read(): tried to read a branch that did not exist in the TTree, this can happen if you tried to read e.g. event.lc_uint(\"run\") but the data type of the corresponding TBranch was something else, like 'int'.");
+  // Returns the slot of a branch, throwing an exception with the given
+  // message if the branch does not exist
+  inline ArraySlot<T>& get_slot(const HashKey& id_hash, const char* err) {
+    const auto it = slot_index.find(id_hash);
+    if (it == slot_index.end()) {
+      throw std::runtime_error(err);
     }
+    return slots[it->second];
   }
 
-  bool has_key(const unsigned int& id_hash) {
-    return reader_cache.find(id_hash) != reader_cache.end();
+  // Resolves the branch once and returns a handle for fast access
+  BranchHandle<T[]> handle(const HashKey& id_hash) {
+    return BranchHandle<T[]>(&get_slot(id_hash, "LazyArrayReader::handle(): tried to get a handle to a branch that did not exist in the TTree, double check branch name and datatype against TTree structure"));
+  }
+
+  // Reads the branch for the current event. Calling this is optional, as
+  // get() and get_vec() read the branch on demand, and it is cheap to call
+  // it repeatedly in the same event.
+  void read(const HashKey& id_hash) {
+    get_slot(id_hash, "read(): tried to read a branch that did not exist in the TTree, this can happen if you tried to read e.g. event.lc_uint(\"run\") but the data type of the corresponding TBranch was something else, like 'int'.").read();
+  }
+
+  bool has_key(const HashKey& id_hash) {
+    return slot_index.find(id_hash) != slot_index.end();
   }
 
   // Gets the value stored in a specific array at a specific index
-  inline T get(const unsigned int& id_hash, unsigned int idx) const {
-    // const TTreeReaderArray<T>& val = *reader_cache.at(id_hash);
-    // return (*reader_cache.at(id_hash))[idx];
-    if (value_cache.find(id_hash) != value_cache.end()) {
-      return value_cache.at(id_hash)[idx];
-    } else {
-      throw std::runtime_error("get(): tried to read a branch that did not exist in the TTree, double check branch name and datatype against TTree structure");
-    }
+  inline T get(const HashKey& id_hash, unsigned int idx) {
+    return get_slot(id_hash, "get(): tried to read a branch that did not exist in the TTree, double check branch name and datatype against TTree structure").get_view()[idx];
   }
 
-  // Gets the full vector
-  inline ROOT::VecOps::RVec<T> get_vec(const unsigned int& id_hash) const {
-    if (value_cache.find(id_hash) != value_cache.end()) {
-      return value_cache.at(id_hash);
-    } else {
-      throw std::runtime_error("get_vec(): tried to read a branch that did not exist in the TTree, double check branch name and datatype against TTree structure");
-    }
+  // Gets a view of the full array, valid until the next reader.Next() in
+  // ArrayReadMode::View
+  inline ArrayView<T> get_vec(const HashKey& id_hash) {
+    return get_slot(id_hash, "get_vec(): tried to read a branch that did not exist in the TTree, double check branch name and datatype against TTree structure").get_view();
   }
 };
 
 // Wraps numbers (values) of a specific type from a TTree to TTreeReaderValue-s
+// Like the arrays, the values are read on demand once per event.
 template <typename T>
 class LazyValueReader {
  public:
-  unordered_map<unsigned int, unique_ptr<TTreeReaderValue<T>>> reader_cache;
-  unordered_map<unsigned int, T> value_cache;
+  deque<ValueSlot<T>> slots;
+  unordered_map<HashKey, unsigned int> slot_index;
   TTreeReader& reader;
+  const unsigned long long& generation;
 
-  LazyValueReader(TTreeReader& _reader) : reader(_reader) {}
+  LazyValueReader(TTreeReader& _reader, const unsigned long long& _generation)
+      : reader(_reader), generation(_generation) {}
 
   void setup(const string& id) {
     // const char* tn =
@@ -154,162 +695,2342 @@ class LazyValueReader {
     //         ->GetTypeName();
     // cout << "Branch: " << tn << " " << id << endl;
     const auto id_hash = string_hash_cpp(id);
-    if (reader_cache.find(id_hash) == reader_cache.end()) {
-      reader_cache[id_hash] =
-          make_unique<TTreeReaderValue<T>>(reader, id.c_str());
+    const auto it = slot_index.find(id_hash);
+    if (it == slot_index.end()) {
+      slot_index[id_hash] = slots.size();
+      slots.emplace_back(reader, id, generation);
+    } else if (slots[it->second].name != id) {
+      throw std::runtime_error("LazyValueReader::setup(): branch names " + slots[it->second].name + " and " + id + " have the same hash");
     }
   }
 
-  void read(const unsigned int& id_hash) {
-    if (reader_cache.find(id_hash) != reader_cache.end()) {
-      value_cache[id_hash] = **reader_cache.at(id_hash);
-    } else {
-      throw std::runtime_error("LazyValueReader::read(): tried to read a branch that did not exist in the TTree");
+  inline ValueSlot<T>& get_slot(const HashKey& id_hash, const char* err) {
+    const auto it = slot_index.find(id_hash);
+    if (it == slot_index.end()) {
+      throw std::runtime_error(err);
     }
+    return slots[it->second];
+  }
+
+  // Resolves the branch once and returns a handle for fast access
+  BranchHandle<T> handle(const HashKey& id_hash) {
+    return BranchHandle<T>(&get_slot(id_hash, "LazyValueReader::handle(): tried to get a handle to a branch that did not exist in the TTree"));
+  }
+
+  void read(const HashKey& id_hash) {
+    get_slot(id_hash, "LazyValueReader::read(): tried to read a branch that did not exist in the TTree").read();
   }
   
-  bool has_key(const unsigned int& id_hash) {
-    return reader_cache.find(id_hash) != reader_cache.end();
+  bool has_key(const HashKey& id_hash) {
+    return slot_index.find(id_hash) != slot_index.end();
   }
 
-  inline T get(const unsigned int& id_hash) const {
-    if (value_cache.find(id_hash) != value_cache.end()) {
-      return value_cache.at(id_hash);
-    } else {
-      throw std::runtime_error("LazyValueReader::get(): tried to read a branch that did not exist in the TTree");
+  inline T get(const HashKey& id_hash) {
+    return get_slot(id_hash, "LazyValueReader::get(): tried to read a branch that did not exist in the TTree").get_value();
+  }
+};
+
+// Keeps track of the branches that were used in the files processed so far,
+// for each file schema (the list of branch names and types). This allows the
+// branches to be pruned in the following files with the same schema without
+// having to learn the used branches again.
+class BranchUsageRegistry {
+ public:
+  static BranchUsageRegistry& instance() {
+    static BranchUsageRegistry registry;
+    return registry;
+  }
+
+  // Fills the used branches for the schema, returns false if unknown
+  bool find(size_t schema_id, unordered_set<string>& used) {
+    lock_guard<mutex> lock(mtx);
+    const auto it = used_branches.find(schema_id);
+    if (it == used_branches.end()) {
+      return false;
+    }
+    used = it->second;
+    return true;
+  }
+
+  // Adds the used branches to the schema
+  void add(size_t schema_id, const unordered_set<string>& used) {
+    lock_guard<mutex> lock(mtx);
+    used_branches[schema_id].insert(used.begin(), used.end());
+  }
+
+ private:
+  mutex mtx;
+  unordered_map<size_t, unordered_set<string>> used_branches;
+};
+
+// The leaf types that can be read from a TTree
+enum class LeafDType {
+  Bool,
+  Char,
+  UChar,
+  Short,
+  UShort,
+  Int,
+  UInt,
+  Long64,
+  ULong64,
+  Float,
+  Double,
+  Unknown
+};
+
+static const unsigned int num_leaf_dtypes = static_cast<unsigned int>(LeafDType::Unknown);
+
+// Maps the C++ type of a leaf to its LeafDType and ROOT type name
+template <typename T>
+struct LeafDTypeOf;
+
+#define NANOFLOW_LEAF_DTYPE(TYPE, DTYPE)                                     \
+  template <>                                                                \
+  struct LeafDTypeOf<TYPE> {                                                 \
+    static constexpr LeafDType value = LeafDType::DTYPE;                     \
+    static const char* name() { return #TYPE; }                              \
+  };
+NANOFLOW_LEAF_DTYPE(Bool_t, Bool)
+NANOFLOW_LEAF_DTYPE(Char_t, Char)
+NANOFLOW_LEAF_DTYPE(UChar_t, UChar)
+NANOFLOW_LEAF_DTYPE(Short_t, Short)
+NANOFLOW_LEAF_DTYPE(UShort_t, UShort)
+NANOFLOW_LEAF_DTYPE(Int_t, Int)
+NANOFLOW_LEAF_DTYPE(UInt_t, UInt)
+NANOFLOW_LEAF_DTYPE(Long64_t, Long64)
+NANOFLOW_LEAF_DTYPE(ULong64_t, ULong64)
+NANOFLOW_LEAF_DTYPE(Float_t, Float)
+NANOFLOW_LEAF_DTYPE(Double_t, Double)
+#undef NANOFLOW_LEAF_DTYPE
+
+template <typename T>
+struct TypeTag {
+  using type = T;
+};
+
+// Calls f(TypeTag<T>()) with the C++ type T corresponding to dtype, such that
+// the same generic code can handle all the leaf types, e.g.
+//   dispatch_leaf_dtype(dtype, [&](auto tag) {
+//     using T = typename decltype(tag)::type;
+//   });
+template <class F>
+static inline void dispatch_leaf_dtype(LeafDType dtype, F&& f) {
+  switch (dtype) {
+    case LeafDType::Bool: f(TypeTag<Bool_t>()); break;
+    case LeafDType::Char: f(TypeTag<Char_t>()); break;
+    case LeafDType::UChar: f(TypeTag<UChar_t>()); break;
+    case LeafDType::Short: f(TypeTag<Short_t>()); break;
+    case LeafDType::UShort: f(TypeTag<UShort_t>()); break;
+    case LeafDType::Int: f(TypeTag<Int_t>()); break;
+    case LeafDType::UInt: f(TypeTag<UInt_t>()); break;
+    case LeafDType::Long64: f(TypeTag<Long64_t>()); break;
+    case LeafDType::ULong64: f(TypeTag<ULong64_t>()); break;
+    case LeafDType::Float: f(TypeTag<Float_t>()); break;
+    case LeafDType::Double: f(TypeTag<Double_t>()); break;
+    default:
+      throw std::runtime_error("dispatch_leaf_dtype(): unknown leaf type");
+  }
+}
+
+// Parses the type name given by TLeaf::GetTypeName
+static inline LeafDType parse_leaf_dtype(const string& type_name) {
+  for (unsigned int i = 0; i < num_leaf_dtypes; i++) {
+    const auto dtype = static_cast<LeafDType>(i);
+    const char* name = nullptr;
+    dispatch_leaf_dtype(dtype, [&](auto tag) {
+      name = LeafDTypeOf<typename decltype(tag)::type>::name();
+    });
+    if (type_name == name) {
+      return dtype;
+    }
+  }
+  return LeafDType::Unknown;
+}
+
+// The array and value readers of one leaf type
+class TypedReadersBase {
+ public:
+  virtual ~TypedReadersBase() {}
+  virtual void collect_slots(vector<BranchSlot*>& slots) = 0;
+  virtual void set_array_read_mode(ArrayReadMode mode) = 0;
+};
+
+template <typename T>
+class TypedReaders : public TypedReadersBase {
+ public:
+  LazyArrayReader<T> arrays;
+  LazyValueReader<T> values;
+
+  TypedReaders(TTreeReader& reader, const unsigned long long& generation)
+      : arrays(reader, generation), values(reader, generation) {}
+
+  virtual void collect_slots(vector<BranchSlot*>& slots) override {
+    for (auto& slot : arrays.slots) {
+      slots.push_back(&slot);
     }
+    for (auto& slot : values.slots) {
+      slots.push_back(&slot);
+    }
+  }
+
+  virtual void set_array_read_mode(ArrayReadMode mode) override {
+    arrays.read_mode = mode;
   }
 };
 
+// Describes a branch in the NanoEvent branch table
+class BranchInfo {
+ public:
+  string name;
+  LeafDType dtype;
+  bool is_array;
+  // Points to an ArraySlot<T> or ValueSlot<T> of the corresponding type
+  BranchSlot* slot;
+};
+
 // Wraps the full NanoAOD event with branches of different types
 // to Array and Value readers automatically
 class NanoEvent {
  public:
-  LazyArrayReader<Float_t> lc_vfloat;
-  LazyArrayReader<Int_t> lc_vint;
-  LazyArrayReader<UInt_t> lc_vuint;
-  LazyArrayReader<Bool_t> lc_vbool;
-  LazyArrayReader<UChar_t> lc_vuchar;
+  TTreeReader& reader;
+
+  // Counts the events processed by this NanoEvent, the readers use it to
+  // decide if a branch was already read in the current event. It must be
+  // declared before the readers, which keep a reference to it.
+  unsigned long long generation;
+
+  // The readers of each leaf type, indexed by LeafDType
+  array<unique_ptr<TypedReadersBase>, num_leaf_dtypes> typed_readers;
+
+  // All the branches in the TTree, keyed by the hash of the branch name
+  unordered_map<HashKey, BranchInfo> branches;
 
-  LazyValueReader<Float_t> lc_float;
-  LazyValueReader<Int_t> lc_int;
-  LazyValueReader<UInt_t> lc_uint;
-  LazyValueReader<Bool_t> lc_bool;
-  LazyValueReader<UChar_t> lc_uchar;
-  LazyValueReader<ULong64_t> lc_ulong64;
+  // Compatibility accessors to the readers of the most common types
+  LazyArrayReader<Float_t>& lc_vfloat;
+  LazyArrayReader<Int_t>& lc_vint;
+  LazyArrayReader<UInt_t>& lc_vuint;
+  LazyArrayReader<Bool_t>& lc_vbool;
+  LazyArrayReader<UChar_t>& lc_vuchar;
+
+  LazyValueReader<Float_t>& lc_float;
+  LazyValueReader<Int_t>& lc_int;
+  LazyValueReader<UInt_t>& lc_uint;
+  LazyValueReader<Bool_t>& lc_bool;
+  LazyValueReader<UChar_t>& lc_uchar;
+  LazyValueReader<ULong64_t>& lc_ulong64;
 
   unsigned int run;
   unsigned int luminosityBlock;
   unsigned long long event;
 
+  // All the branches of all the readers, for bookkeeping
+  vector<BranchSlot*> all_slots;
+
+  // Identifies the list of branch names and types in the TTree
+  size_t schema_id;
+
   // Connects all the existing branches from the TTree to Array and Value
   // readers Unless the readers are accessed, there is no overhead from this.
-  NanoEvent(TTreeReader& reader)
-      : lc_vfloat(reader),
-        lc_vint(reader),
-        lc_vuint(reader),
-        lc_vbool(reader),
-        lc_vuchar(reader),
-        lc_float(reader),
-        lc_int(reader),
-        lc_uint(reader),
-        lc_bool(reader),
-        lc_uchar(reader),
-        lc_ulong64(reader) {
+  NanoEvent(TTreeReader& _reader)
+      : reader(_reader),
+        generation(0),
+        typed_readers(make_typed_readers(_reader, generation)),
+        lc_vfloat(readers<Float_t>().arrays),
+        lc_vint(readers<Int_t>().arrays),
+        lc_vuint(readers<UInt_t>().arrays),
+        lc_vbool(readers<Bool_t>().arrays),
+        lc_vuchar(readers<UChar_t>().arrays),
+        lc_float(readers<Float_t>().values),
+        lc_int(readers<Int_t>().values),
+        lc_uint(readers<UInt_t>().values),
+        lc_bool(readers<Bool_t>().values),
+        lc_uchar(readers<UChar_t>().values),
+        lc_ulong64(readers<ULong64_t>().values) {
+    string schema;
     for (auto leaf_obj : *reader.GetTree()->GetListOfLeaves()) {
       TLeaf* leaf = (TLeaf*)leaf_obj;
-      const string dtype(leaf->GetTypeName());
+      const string type_name(leaf->GetTypeName());
       const string leaf_name(leaf->GetName());
+      schema += leaf_name + "/" + type_name + ";";
 
-      // cout << leaf_name << " " << dtype << endl;
-
-      if (leaf->GetLeafCount() != nullptr) {
-        if (dtype == "Float_t") {
-          lc_vfloat.setup(leaf_name);
-        } else if (dtype == "Int_t") {
-          lc_vint.setup(leaf_name);
-        } else if (dtype == "UInt_t") {
-          lc_vuint.setup(leaf_name);
-        } else if (dtype == "Bool_t") {
-          lc_vbool.setup(leaf_name);
-        } else if (dtype == "UChar_t") {
-          lc_vuchar.setup(leaf_name);
-        } else {
-          cerr << "Could not understand array dtype " << dtype << " "
-               << leaf_name << endl;
-        }
-      } else if (leaf->GetLeafCount() == nullptr) {
-        if (dtype == "Float_t") {
-          lc_float.setup(leaf_name);
-        } else if (dtype == "Int_t") {
-          lc_int.setup(leaf_name);
-        } else if (dtype == "UInt_t") {
-          lc_uint.setup(leaf_name);
-        } else if (dtype == "Bool_t") {
-          lc_bool.setup(leaf_name);
-        } else if (dtype == "UChar_t") {
-          lc_uchar.setup(leaf_name);
-        } else if (dtype == "ULong64_t") {
-          lc_ulong64.setup(leaf_name);
-        } else {
-          cerr << "Could not understand number dtype " << dtype << " "
-               << leaf_name << endl;
-        }
+      const auto dtype = parse_leaf_dtype(type_name);
+      if (dtype == LeafDType::Unknown) {
+        cerr << "Could not understand dtype " << type_name << " "
+             << leaf_name << endl;
+        continue;
       }
+
+      // Arrays have either a variable length given by another branch, or a
+      // fixed length
+      const bool is_array =
+          leaf->GetLeafCount() != nullptr || leaf->GetLenStatic() > 1;
+      const string count_name(
+          leaf->GetLeafCount() != nullptr ? leaf->GetLeafCount()->GetName() : "");
+
+      dispatch_leaf_dtype(dtype, [&](auto tag) {
+        using T = typename decltype(tag)::type;
+        this->setup_branch<T>(leaf_name, count_name, is_array);
+      });
+    }
+    schema_id = hash<string>()(schema);
+
+    for (auto& typed : typed_readers) {
+      typed->collect_slots(all_slots);
     }
   }  // constructor
 
-  virtual void analyze() = 0;
-};
+  static array<unique_ptr<TypedReadersBase>, num_leaf_dtypes> make_typed_readers(
+      TTreeReader& reader, const unsigned long long& generation) {
+    array<unique_ptr<TypedReadersBase>, num_leaf_dtypes> ret;
+    for (unsigned int i = 0; i < num_leaf_dtypes; i++) {
+      dispatch_leaf_dtype(static_cast<LeafDType>(i), [&](auto tag) {
+        using T = typename decltype(tag)::type;
+        ret[i] = make_unique<TypedReaders<T>>(reader, generation);
+      });
+    }
+    return ret;
+  }
 
-// Accesses data from the underlying TTree wrapped by a NanoEvent lazily
-// using get_DTYPE(key) methods, e.g. get_float(string_hash("Jet_pt"))
-// Each LazyObject contains an index, which corresponds to the index in the
-// NanoAOD arrays.
-class LazyObject {
- public:
-  // the reference to the parent NanoAOD event
-  NanoEvent* event;
+  // The array and value readers of the leaf type T
+  template <typename T>
+  inline TypedReaders<T>& readers() {
+    return static_cast<TypedReaders<T>&>(
+        *typed_readers[static_cast<unsigned int>(LeafDTypeOf<T>::value)]);
+  }
 
-  // the index of the object in the object array
-  unsigned int index;
+  // Creates the reader of one branch and adds it to the branch table. The
+  // keys are shared by the readers of all types, so two branch names with the
+  // same hash would silently return the wrong data: fail instead.
+  template <typename T>
+  void setup_branch(const string& name, const string& count_name, bool is_array) {
+    const auto id_hash = string_hash_cpp(name);
+    const auto it = branches.find(id_hash);
+    if (it != branches.end()) {
+      if (it->second.name != name) {
+        throw std::runtime_error("NanoEvent: branch names " + it->second.name + " and " + name + " have the same hash " + to_string(id_hash) + ", cannot access them by key");
+      }
+      return;
+    }
+    auto& typed = readers<T>();
+    BranchInfo info;
+    info.name = name;
+    info.dtype = LeafDTypeOf<T>::value;
+    info.is_array = is_array;
+    if (is_array) {
+      typed.arrays.setup(name, count_name);
+      info.slot = &typed.arrays.get_slot(id_hash, "");
+    } else {
+      typed.values.setup(name);
+      info.slot = &typed.values.get_slot(id_hash, "");
+    }
+    branches[id_hash] = info;
+  }
 
-  // unordered_map<unsigned int, float> userfloats;
-  // mutable unordered_map<unsigned int, float> float_cache;
+  // Checks if the branch exists in the TTree, irrespective of its type
+  inline bool has_key(const HashKey& id_hash) const {
+    return branches.find(id_hash) != branches.end();
+  }
 
-  // Initializes the object based on the event and the index
-  LazyObject(NanoEvent* _event, unsigned int _index)
-      : event(_event), index(_index) {}
-  virtual ~LazyObject() {};
+  inline const BranchInfo& branch_info(const HashKey& id_hash) const {
+    const auto it = branches.find(id_hash);
+    if (it == branches.end()) {
+      throw std::runtime_error("NanoEvent::branch_info(): tried to access a branch that did not exist in the TTree");
+    }
+    return it->second;
+  }
 
-  // Caching does not seem to be necessary
-  // //Retrieves a float from the object
-  // Float_t get_float(const unsigned int string_hash) const {
-  //     const auto& cache_key = float_cache.find(string_hash);
-  //     if (cache_key == float_cache.end()) {
-  //         const auto& v = event.lc_vfloat.get(string_hash, index);
-  //         float_cache[string_hash] = v;
+  // The slot of a branch, checking that the type is what the caller expects
+  template <typename T>
+  inline BranchSlot* typed_slot(const HashKey& id_hash, bool is_array) const {
+    const auto& info = branch_info(id_hash);
+    if (info.dtype != LeafDTypeOf<T>::value || info.is_array != is_array) {
+      throw std::runtime_error("NanoEvent: branch " + info.name + " was accessed as " + (is_array ? "array of " : "") + LeafDTypeOf<T>::name() + ", but it has a different type");
+    }
+    return info.slot;
+  }
+
+  // Gets the value of a number branch of type T, e.g. get<UInt_t>(string_hash("nMuon"))
+  template <typename T>
+  inline T get(const HashKey& id_hash) {
+    return static_cast<ValueSlot<T>*>(typed_slot<T>(id_hash, false))->get_value();
+  }
+
+  // Gets a view of an array branch of type T
+  template <typename T>
+  inline ArrayView<T> get_vec(const HashKey& id_hash) {
+    return static_cast<ArraySlot<T>*>(typed_slot<T>(id_hash, true))->get_view();
+  }
+
+  // Gets the value of a number branch of any type, converted to T. This is
+  // useful for branches with a type that changed between versions, e.g. run
+  template <typename T>
+  T get_as(const HashKey& id_hash) {
+    const auto& info = branch_info(id_hash);
+    if (info.is_array) {
+      throw std::runtime_error("NanoEvent::get_as(): branch " + info.name + " is an array");
+    }
+    T ret = T();
+    dispatch_leaf_dtype(info.dtype, [&](auto tag) {
+      using U = typename decltype(tag)::type;
+      ret = static_cast<T>(static_cast<ValueSlot<U>*>(info.slot)->get_value());
+    });
+    return ret;
+  }
+
+  // Resolves a branch once and returns a handle for fast access, e.g.
+  // handle<UInt_t>(string_hash("nMuon")) or handle<Float_t[]>(string_hash("Muon_pt"))
+  template <typename H>
+  inline BranchHandle<H> handle(const HashKey& id_hash) {
+    return make_handle(id_hash, TypeTag<H>());
+  }
+
+  template <typename T>
+  inline BranchHandle<T> make_handle(const HashKey& id_hash, TypeTag<T>) {
+    return BranchHandle<T>(static_cast<ValueSlot<T>*>(typed_slot<T>(id_hash, false)));
+  }
+
+  template <typename T>
+  inline BranchHandle<T[]> make_handle(const HashKey& id_hash, TypeTag<T[]>) {
+    return BranchHandle<T[]>(static_cast<ArraySlot<T>*>(typed_slot<T>(id_hash, true)));
+  }
+
+  // Must be called after every reader.Next(), such that the branches are
+  // read again on the next access. looper_main takes care of this.
+  inline void next_generation() { generation += 1; }
+
+  // Chooses whether array branches are exposed as zero-copy views of the
+  // TTreeReader buffers (default) or copied to owned RVecs on read()
+  void set_array_read_mode(ArrayReadMode mode) {
+    for (auto& typed : typed_readers) {
+      typed->set_array_read_mode(mode);
+    }
+  }
+
+  // Prepares the pruning of unused branches. If the used branches are known
+  // from a previous file with the same schema, the unused ones are disabled
+  // right away. Otherwise, the used branches need to be learned by processing
+  // learn_events events before calling prune_branches().
+  // Returns the number of events to learn from, 0 if nothing needs to be done.
+  int start_branch_pruning(int learn_events) {
+    if (learn_events <= 0) {
+      return 0;
+    }
+    unordered_set<string> used;
+    if (BranchUsageRegistry::instance().find(schema_id, used)) {
+      prune_branches(used);
+      return 0;
+    }
+    cout << "Learning the used branches from the first " << learn_events
+         << " events" << endl;
+    return learn_events;
+  }
+
+  // Disables all the branches in the TTree which have not been accessed so
+  // far and are not in keep_branches, and restricts the TTreeCache to the
+  // remaining ones. A disabled branch is enabled again if it is accessed
+  // later on, so this is always safe, but it costs some I/O efficiency.
+  void prune_branches(const unordered_set<string>& keep_branches = {}) {
+    unordered_set<string> keep(keep_branches);
+    for (const auto* slot : all_slots) {
+      if (slot->used) {
+        keep.insert(slot->name);
+      }
+    }
+    // Arrays can only be read together with the branch holding their length
+    for (const auto* slot : all_slots) {
+      if (!slot->count_name.empty() && keep.find(slot->name) != keep.end()) {
+        keep.insert(slot->count_name);
+      }
+    }
+
+    auto* tree = reader.GetTree();
+    tree->SetBranchStatus("*", 0);
+    tree->DropBranchFromCache("*", true);
+
+    unsigned int num_enabled = 0;
+    for (auto* slot : all_slots) {
+      if (keep.find(slot->name) != keep.end()) {
+        tree->SetBranchStatus(slot->name.c_str(), 1);
+        tree->AddBranchToCache(slot->name.c_str(), true);
+        slot->pruned = false;
+        num_enabled += 1;
+      } else {
+        slot->pruned = true;
+      }
+    }
+    tree->StopCacheLearningPhase();
+
+    cout << "Pruned branches, keeping " << num_enabled << "/"
+         << all_slots.size() << " branches enabled" << endl;
+  }
+
+  // Stores the branches used in this file, such that the following files
+  // with the same schema can be pruned right away
+  void save_branch_usage() const {
+    unordered_set<string> used;
+    for (const auto* slot : all_slots) {
+      if (slot->used) {
+        used.insert(slot->name);
+      }
+    }
+    BranchUsageRegistry::instance().add(schema_id, used);
+  }
+
+  virtual void analyze() = 0;
+};
+
+// Accesses data from the underlying TTree wrapped by a NanoEvent lazily
+// using get_DTYPE(key) methods, e.g. get_float(string_hash("Jet_pt"))
+// Each LazyObject contains an index, which corresponds to the index in the
+// NanoAOD arrays.
+class LazyObject {
+ public:
+  // the reference to the parent NanoAOD event
+  NanoEvent* event;
+
+  // the index of the object in the object array
+  unsigned int index;
+
+  // unordered_map<unsigned int, float> userfloats;
+  // mutable unordered_map<unsigned int, float> float_cache;
+
+  // Initializes the object based on the event and the index
+  LazyObject(NanoEvent* _event, unsigned int _index)
+      : event(_event), index(_index) {}
+  virtual ~LazyObject() {};
+
+  // Caching does not seem to be necessary
+  // //Retrieves a float from the object
+  // Float_t get_float(const HashKey string_hash) const {
+  //     const auto& cache_key = float_cache.find(string_hash);
+  //     if (cache_key == float_cache.end()) {
+  //         const auto& v = event.lc_vfloat.get(string_hash, index);
+  //         float_cache[string_hash] = v;
   //         return v;
   //     }
   //     return cache_key->second;
   // }
 
-  // Retrieves a float from the object
-  Float_t get_float(const unsigned int string_hash) const {
-    return event->lc_vfloat.get(string_hash, index);
+  // Retrieves a float from the object
+  Float_t get_float(const HashKey string_hash) const {
+    return event->lc_vfloat.get(string_hash, index);
+  }
+
+  // Retrieves an int from the object
+  Int_t get_int(const HashKey string_hash) const {
+    return event->lc_vint.get(string_hash, index);
+  }
+
+  // Retrieves the value of this object from a branch handle, which avoids
+  // the hash map lookup of get_float and get_int
+  template <typename T>
+  inline T get(const BranchHandle<T[]>& handle) const {
+    return handle[index];
+  }
+
+};
+
+// A lightweight reference to one object of a Collection, used as
+// collection[i].pt() instead of collection.pt[i]
+template <typename Schema>
+class CollectionProxy;
+
+// A structure-of-arrays view of a NanoAOD object collection, e.g. the muons.
+// The pt, eta, phi and mass columns point directly to the buffers of the
+// Schema::name() + "_pt", ... branches, the user columns in Schema::Columns
+// are filled by the analyzers. The Schema looks like
+//
+//   class MuonSchema {
+//    public:
+//     static const char* name() { return "Muon"; }
+//     class Columns {
+//      public:
+//       vector<int> matchidx;
+//       void resize(unsigned int n) { matchidx.assign(n, -1); }
+//     };
+//   };
+//
+// The branches are resolved once when the Collection is constructed, read()
+// must be called once per event before the columns are accessed.
+template <typename Schema>
+class Collection {
+ public:
+  typedef CollectionProxy<Schema> Proxy;
+
+  ArrayView<Float_t> pt;
+  ArrayView<Float_t> eta;
+  ArrayView<Float_t> phi;
+  ArrayView<Float_t> mass;
+
+  // The user columns, with one entry per object
+  typename Schema::Columns columns;
+
+  Collection(NanoEvent& event)
+      : pt_branch(event.handle<Float_t[]>(branch_hash("_pt"))),
+        eta_branch(event.handle<Float_t[]>(branch_hash("_eta"))),
+        phi_branch(event.handle<Float_t[]>(branch_hash("_phi"))),
+        mass_branch(event.handle<Float_t[]>(branch_hash("_mass"))),
+        num_objects(0) {}
+
+  // Points the columns to the branches of the current event, reading them
+  // from disk if necessary, and resets the user columns
+  void read() {
+    pt = pt_branch.get_vec();
+    eta = eta_branch.get_vec();
+    phi = phi_branch.get_vec();
+    mass = mass_branch.get_vec();
+    num_objects = static_cast<unsigned int>(pt.size());
+    columns.resize(num_objects);
+  }
+
+  void clear() {
+    pt = eta = phi = mass = ArrayView<Float_t>();
+    num_objects = 0;
+    columns.resize(0);
+  }
+
+  inline unsigned int size() const { return num_objects; }
+  inline bool empty() const { return num_objects == 0; }
+
+  inline Proxy operator[](unsigned int idx) { return Proxy(*this, idx); }
+
+  inline Proxy at(unsigned int idx) {
+    if (idx >= num_objects) {
+      throw std::out_of_range("Collection::at(): index out of range");
+    }
+    return Proxy(*this, idx);
+  }
+
+ private:
+  BranchHandle<Float_t[]> pt_branch;
+  BranchHandle<Float_t[]> eta_branch;
+  BranchHandle<Float_t[]> phi_branch;
+  BranchHandle<Float_t[]> mass_branch;
+  unsigned int num_objects;
+
+  static HashKey branch_hash(const char* suffix) {
+    return string_hash_cpp(string(Schema::name()) + suffix);
+  }
+};
+
+template <typename Schema>
+class CollectionProxy {
+ public:
+  Collection<Schema>& collection;
+  unsigned int index;
+
+  CollectionProxy(Collection<Schema>& _collection, unsigned int _index)
+      : collection(_collection), index(_index) {}
+
+  inline Float_t pt() const { return collection.pt[index]; }
+  inline Float_t eta() const { return collection.eta[index]; }
+  inline Float_t phi() const { return collection.phi[index]; }
+  inline Float_t mass() const { return collection.mass[index]; }
+
+  inline PtEtaPhiM p4() const { return PtEtaPhiM{pt(), eta(), phi(), mass()}; }
+
+  // The user columns of the collection, to be indexed with index
+  inline typename Schema::Columns& columns() const {
+    return collection.columns;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                              COMBINATORICS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// The objects that are combined to pairs, triplets or quadruplets, in
+// cartesian coordinates such that the four-vectors of a combination are
+// simple sums. Objects of several collections can be added, e.g. the
+// electrons and the muons with different flavours for H->ZZ->4l. The
+// buffers are reused, such that filling the input in every event does not
+// allocate once they are large enough.
+class CombinationInput {
+ public:
+  vector<float> px;
+  vector<float> py;
+  vector<float> pz;
+  vector<float> e;
+  vector<int> charge;
+  vector<int> flavour;
+  // The index of each object in its collection
+  vector<unsigned int> source;
+
+  inline size_t size() const { return px.size(); }
+
+  inline PxPyPzE p4(unsigned int i) const { return PxPyPzE{px[i], py[i], pz[i], e[i]}; }
+
+  void clear() {
+    px.clear();
+    py.clear();
+    pz.clear();
+    e.clear();
+    charge.clear();
+    flavour.clear();
+    source.clear();
+  }
+
+  // Adds n objects given as NanoAOD columns with the same flavour, e.g. the
+  // PDG ID. The charges may be nullptr if the constraints do not use them.
+  // With MathMode::Fast, the conversion to cartesian coordinates is faster,
+  // but the masses of nearly collinear pairs lose a few more digits.
+  void add(const float* pt, const float* eta, const float* phi, const float* mass,
+           const int* charges, size_t n, int flavour_id = 0,
+           simd::MathMode mode = simd::MathMode::Exact) {
+    const size_t start = size();
+    px.resize(start + n);
+    py.resize(start + n);
+    pz.resize(start + n);
+    e.resize(start + n);
+    to_cartesian(pt, eta, phi, mass, n, px.data() + start, py.data() + start,
+                 pz.data() + start, e.data() + start, mode);
+    for (size_t i = 0; i < n; i++) {
+      charge.push_back(charges != nullptr ? charges[i] : 0);
+      flavour.push_back(flavour_id);
+      source.push_back(static_cast<unsigned int>(i));
+    }
+  }
+
+  template <typename Schema>
+  void add(const Collection<Schema>& objects, const int* charges, int flavour_id = 0,
+           simd::MathMode mode = simd::MathMode::Exact) {
+    add(objects.pt.data(), objects.eta.data(), objects.phi.data(), objects.mass.data(),
+        charges, objects.size(), flavour_id, mode);
+  }
+};
+
+// The requirements on a pair of objects, e.g. PairConstraint{true, true} for
+// the same-flavour opposite-charge lepton pairs of a Z decay
+class PairConstraint {
+ public:
+  bool opposite_charge;
+  bool same_flavour;
+
+  inline bool accept(const CombinationInput& a, unsigned int i, const CombinationInput& b,
+                     unsigned int j) const {
+    return (!opposite_charge || a.charge[i] * b.charge[j] < 0) &&
+           (!same_flavour || a.flavour[i] == b.flavour[j]);
+  }
+
+  inline bool accept(const CombinationInput& in, unsigned int i, unsigned int j) const {
+    return accept(in, i, in, j);
+  }
+};
+
+// The combinations of k = 2, 3 or 4 objects, stored as structure of arrays:
+// combination ic consists of the objects index[0][ic] ... index[k - 1][ic] of
+// the input, and its four-vector is (px[ic], py[ic], pz[ic], e[ic]) with the
+// invariant mass mass[ic] (negative if spacelike, as PxPyPzE::mass()).
+// Filled by make_pairs, make_triplets and make_quadruplets, which reuse the
+// buffers such that the steady-state event loop does not allocate.
+class Combinations {
+ public:
+  unsigned int k;
+  array<vector<unsigned int>, 4> index;
+  vector<float> px;
+  vector<float> py;
+  vector<float> pz;
+  vector<float> e;
+  vector<float> mass;
+
+  Combinations() : k(0) {}
+
+  inline size_t size() const { return index[0].size(); }
+  inline bool empty() const { return index[0].empty(); }
+
+  inline PxPyPzE p4(unsigned int ic) const { return PxPyPzE{px[ic], py[ic], pz[ic], e[ic]}; }
+
+  void clear(unsigned int num_objects) {
+    k = num_objects;
+    for (auto& idx : index) {
+      idx.clear();
+    }
+  }
+
+  // The combination with the highest metric(ic), -1 if there are none. E.g.
+  // the pair closest to the Z mass is
+  //   best([&](unsigned int ic) { return -std::abs(pairs.mass[ic] - 91.19f); })
+  template <class Metric>
+  int best(Metric metric) const {
+    int ret = -1;
+    float best_value = 0.0f;
+    for (unsigned int ic = 0; ic < size(); ic++) {
+      const float value = metric(ic);
+      if (ret < 0 || value > best_value) {
+        ret = static_cast<int>(ic);
+        best_value = value;
+      }
+    }
+    return ret;
+  }
+
+  // Writes the (at most) num_best combinations with the highest metric(ic)
+  // to out, in decreasing order of the metric. Ties are broken by the index.
+  template <class Metric>
+  void top_k(size_t num_best, Metric metric, vector<unsigned int>& out) const {
+    out.resize(size());
+    for (unsigned int ic = 0; ic < size(); ic++) {
+      out[ic] = ic;
+    }
+    const size_t num = std::min(num_best, out.size());
+    std::partial_sort(out.begin(), out.begin() + num, out.end(),
+                      [&](unsigned int a, unsigned int b) {
+                        const float ma = metric(a);
+                        const float mb = metric(b);
+                        return ma > mb || (ma == mb && a < b);
+                      });
+    out.resize(num);
+  }
+
+  // Sums the four-vectors of the objects of each combination, the objects in
+  // slot j are taken from *inputs[j]. The loops run over all combinations
+  // with the object indices as gathers, see gather.
+  void compute_p4(const array<const CombinationInput*, 4>& inputs) {
+    const size_t n = size();
+    px.resize(n);
+    py.resize(n);
+    pz.resize(n);
+    e.resize(n);
+    mass.resize(n);
+    for (unsigned int j = 0; j < k; j++) {
+      const unsigned int* idx = index[j].data();
+      gather(inputs[j]->px.data(), idx, n, j > 0, px.data());
+      gather(inputs[j]->py.data(), idx, n, j > 0, py.data());
+      gather(inputs[j]->pz.data(), idx, n, j > 0, pz.data());
+      gather(inputs[j]->e.data(), idx, n, j > 0, e.data());
+    }
+    // mass = sign(m2) sqrt(|m2|), the vector square root is correctly rounded
+    for (size_t ic = 0; ic < n; ic++) {
+      mass[ic] = std::abs(e[ic] * e[ic] - (px[ic] * px[ic] + py[ic] * py[ic] + pz[ic] * pz[ic]));
+    }
+    simd::sqrt(mass.data(), n, mass.data(), simd::MathMode::Fast);
+    for (size_t ic = 0; ic < n; ic++) {
+      const float m2 = e[ic] * e[ic] - (px[ic] * px[ic] + py[ic] * py[ic] + pz[ic] * pz[ic]);
+      mass[ic] = m2 < 0.0f ? -mass[ic] : mass[ic];
+    }
+  }
+
+ private:
+  // out[i] = in[idx[i]], or out[i] += in[idx[i]] if add. The arrays are
+  // __restrict parameters, GCC ignores __restrict on local pointers and
+  // would not vectorize the loops otherwise.
+  static inline void gather(const float* __restrict in, const unsigned int* __restrict idx,
+                            size_t n, bool add, float* __restrict out) {
+    if (add) {
+      for (size_t i = 0; i < n; i++) {
+        out[i] += in[idx[i]];
+      }
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = in[idx[i]];
+      }
+    }
+  }
+};
+
+// All the pairs i < j of objects of one input that satisfy the constraint
+static inline void make_pairs(const CombinationInput& in, const PairConstraint& constraint,
+                              Combinations& out) {
+  out.clear(2);
+  const unsigned int n = in.size();
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = i + 1; j < n; j++) {
+      if (constraint.accept(in, i, j)) {
+        out.index[0].push_back(i);
+        out.index[1].push_back(j);
+      }
+    }
+  }
+  out.compute_p4({&in, &in, nullptr, nullptr});
+}
+
+// All the pairs of an object i of a and an object j of b that satisfy the
+// constraint, e.g. a lepton and a jet
+static inline void make_pairs(const CombinationInput& a, const CombinationInput& b,
+                              const PairConstraint& constraint, Combinations& out) {
+  out.clear(2);
+  for (unsigned int i = 0; i < a.size(); i++) {
+    for (unsigned int j = 0; j < b.size(); j++) {
+      if (constraint.accept(a, i, b, j)) {
+        out.index[0].push_back(i);
+        out.index[1].push_back(j);
+      }
+    }
+  }
+  out.compute_p4({&a, &b, nullptr, nullptr});
+}
+
+// All the triplets i < j < k of objects of one input that contain at least
+// one pair that satisfies the constraint, e.g. the same-flavour
+// opposite-charge pair of WZ->3l
+static inline void make_triplets(const CombinationInput& in, const PairConstraint& constraint,
+                                 Combinations& out) {
+  out.clear(3);
+  const unsigned int n = in.size();
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = i + 1; j < n; j++) {
+      const bool ij = constraint.accept(in, i, j);
+      for (unsigned int k = j + 1; k < n; k++) {
+        if (ij || constraint.accept(in, i, k) || constraint.accept(in, j, k)) {
+          out.index[0].push_back(i);
+          out.index[1].push_back(j);
+          out.index[2].push_back(k);
+        }
+      }
+    }
+  }
+  out.compute_p4({&in, &in, &in, nullptr});
+}
+
+// All the splits of the quadruplets i < j < k < l of objects of one input
+// into two pairs that both satisfy the constraint, e.g. the two Z candidates
+// of H->ZZ->4l. A quadruplet is stored once per valid split, with the first
+// pair in the slots 0 and 1 and the second pair in the slots 2 and 3, i.e. as
+// (i, j, k, l), (i, k, j, l) or (i, l, j, k).
+static inline void make_quadruplets(const CombinationInput& in,
+                                    const PairConstraint& constraint, Combinations& out) {
+  out.clear(4);
+  const unsigned int n = in.size();
+  auto push = [&out](unsigned int a, unsigned int b, unsigned int c, unsigned int d) {
+    out.index[0].push_back(a);
+    out.index[1].push_back(b);
+    out.index[2].push_back(c);
+    out.index[3].push_back(d);
+  };
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = i + 1; j < n; j++) {
+      const bool ij = constraint.accept(in, i, j);
+      for (unsigned int k = j + 1; k < n; k++) {
+        const bool ik = constraint.accept(in, i, k);
+        const bool jk = constraint.accept(in, j, k);
+        for (unsigned int l = k + 1; l < n; l++) {
+          if (ij && constraint.accept(in, k, l)) {
+            push(i, j, k, l);
+          }
+          if (ik && constraint.accept(in, j, l)) {
+            push(i, k, j, l);
+          }
+          if (jk && constraint.accept(in, i, l)) {
+            push(i, l, j, k);
+          }
+        }
+      }
+    }
+  }
+  out.compute_p4({&in, &in, &in, &in});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                                 MATCHING                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// Matches the objects of a collection to those of another one by their
+// distance in (eta, phi), e.g. the reconstructed muons to the generator
+// muons. Every object is matched at most once, and only pairs with
+// deltaR < max_dr and, optionally, |pt_reco - pt_gen| < max_pt_rel_diff *
+// pt_gen are matched. The algorithm is either
+//  - Greedy: the pairs are matched in the order of increasing deltaR
+//  - Optimal: the number of matches is maximized and then the sum of the
+//    squared deltaR is minimized with the Hungarian algorithm. This is only
+//    done if both collections have at most MAX_OPTIMAL objects, larger
+//    events are matched greedily.
+// The deltaR matrix is computed one row at a time with the vectorized
+// simd::delta_r2. The buffers are reused, such that the steady-state event
+// loop does not allocate.
+class DeltaRMatcher {
+ public:
+  enum class Algorithm { Greedy, Optimal };
+
+  static const unsigned int MAX_OPTIMAL = 8;
+
+  float max_dr;
+  float max_pt_rel_diff;
+  Algorithm algorithm;
+
+  // The squared deltaR of the pairs of the last call to match(), stored as
+  // dr2[ireco * num_gen + igen], infinity for the pairs that fail the cuts
+  vector<float> dr2;
+
+  DeltaRMatcher(float _max_dr, Algorithm _algorithm = Algorithm::Greedy,
+                float _max_pt_rel_diff = std::numeric_limits<float>::infinity())
+      : max_dr(_max_dr), max_pt_rel_diff(_max_pt_rel_diff), algorithm(_algorithm) {
+    if (!(max_dr > 0.0f) || !std::isfinite(max_dr)) {
+      throw std::runtime_error("DeltaRMatcher: max_dr must be positive and finite");
+    }
+  }
+
+  // Sets matchidx[ireco] to the index of the gen object matched to reco object
+  // ireco, -1 if it is not matched, and returns the number of matches. The pt
+  // arrays are only used for the pt cut and may be nullptr without it.
+  unsigned int match(const float* reco_pt, const float* reco_eta, const float* reco_phi,
+                     size_t num_reco, const float* gen_pt, const float* gen_eta,
+                     const float* gen_phi, size_t num_gen, int* matchidx) {
+    std::fill(matchidx, matchidx + num_reco, -1);
+    if (num_reco == 0 || num_gen == 0) {
+      dr2.clear();
+      return 0;
+    }
+
+    const float max_dr2 = max_dr * max_dr;
+    const bool cut_pt = std::isfinite(max_pt_rel_diff);
+    dr2.resize(num_reco * num_gen);
+    for (size_t ireco = 0; ireco < num_reco; ireco++) {
+      float* row = dr2.data() + ireco * num_gen;
+      simd::delta_r2(reco_eta[ireco], reco_phi[ireco], gen_eta, gen_phi, num_gen, row);
+      for (size_t igen = 0; igen < num_gen; igen++) {
+        const bool pass_pt =
+            !cut_pt || std::abs(reco_pt[ireco] - gen_pt[igen]) < max_pt_rel_diff * gen_pt[igen];
+        row[igen] = (row[igen] < max_dr2 && pass_pt) ? row[igen]
+                                                      : std::numeric_limits<float>::infinity();
+      }
+    }
+
+    if (algorithm == Algorithm::Optimal && num_reco <= MAX_OPTIMAL && num_gen <= MAX_OPTIMAL) {
+      return match_optimal(num_reco, num_gen, matchidx);
+    }
+    return match_greedy(num_reco, num_gen, matchidx);
+  }
+
+  // Matches the objects of two Collections, matchidx needs room for
+  // reco.size() entries, e.g. reco.columns.matchidx.data()
+  template <typename RecoSchema, typename GenSchema>
+  unsigned int match(const Collection<RecoSchema>& reco, const Collection<GenSchema>& gen,
+                     int* matchidx) {
+    return match(reco.pt.data(), reco.eta.data(), reco.phi.data(), reco.size(), gen.pt.data(),
+                 gen.eta.data(), gen.phi.data(), gen.size(), matchidx);
+  }
+
+ private:
+  // The candidate pairs of the greedy matching and the used gen objects
+  vector<unsigned int> pairs;
+  vector<uint8_t> gen_used;
+
+  unsigned int match_greedy(size_t num_reco, size_t num_gen, int* matchidx) {
+    pairs.clear();
+    for (unsigned int k = 0; k < dr2.size(); k++) {
+      if (dr2[k] < std::numeric_limits<float>::infinity()) {
+        pairs.push_back(k);
+      }
+    }
+    // ties are broken by the index, such that the result is reproducible
+    std::sort(pairs.begin(), pairs.end(), [&](unsigned int a, unsigned int b) {
+      return dr2[a] < dr2[b] || (dr2[a] == dr2[b] && a < b);
+    });
+    gen_used.assign(num_gen, 0);
+    unsigned int num_matched = 0;
+    for (const auto k : pairs) {
+      const unsigned int ireco = k / num_gen;
+      const unsigned int igen = k % num_gen;
+      if (matchidx[ireco] < 0 && !gen_used[igen]) {
+        matchidx[ireco] = static_cast<int>(igen);
+        gen_used[igen] = 1;
+        num_matched++;
+      }
+    }
+    return num_matched;
+  }
+
+  // The Hungarian algorithm on the square matrix of size max(num_reco,
+  // num_gen), where the pairs failing the cuts and the padding have a cost
+  // larger than the sum of all allowed costs, such that the number of
+  // matches is maximized first. Everything lives on the stack.
+  unsigned int match_optimal(size_t num_reco, size_t num_gen, int* matchidx) const {
+    const unsigned int n = std::max(num_reco, num_gen);
+    const double forbidden = (n + 1.0) * max_dr * max_dr;
+    double cost[MAX_OPTIMAL][MAX_OPTIMAL];
+    for (unsigned int i = 0; i < n; i++) {
+      for (unsigned int j = 0; j < n; j++) {
+        const float c = (i < num_reco && j < num_gen) ? dr2[i * num_gen + j]
+                                                      : std::numeric_limits<float>::infinity();
+        cost[i][j] = c < std::numeric_limits<float>::infinity() ? c : forbidden;
+      }
+    }
+
+    // u, v are the potentials of the rows and columns, col_row[j] the row
+    // assigned to column j, all indexed from 1 with column 0 as the root
+    double u[MAX_OPTIMAL + 1] = {0.0};
+    double v[MAX_OPTIMAL + 1] = {0.0};
+    unsigned int col_row[MAX_OPTIMAL + 1] = {0};
+    unsigned int way[MAX_OPTIMAL + 1] = {0};
+    for (unsigned int i = 1; i <= n; i++) {
+      col_row[0] = i;
+      unsigned int j0 = 0;
+      double minv[MAX_OPTIMAL + 1];
+      bool used[MAX_OPTIMAL + 1];
+      std::fill(minv, minv + n + 1, std::numeric_limits<double>::infinity());
+      std::fill(used, used + n + 1, false);
+      do {
+        used[j0] = true;
+        const unsigned int i0 = col_row[j0];
+        double delta = std::numeric_limits<double>::infinity();
+        unsigned int j1 = 0;
+        for (unsigned int j = 1; j <= n; j++) {
+          if (!used[j]) {
+            const double cur = cost[i0 - 1][j - 1] - u[i0] - v[j];
+            if (cur < minv[j]) {
+              minv[j] = cur;
+              way[j] = j0;
+            }
+            if (minv[j] < delta) {
+              delta = minv[j];
+              j1 = j;
+            }
+          }
+        }
+        for (unsigned int j = 0; j <= n; j++) {
+          if (used[j]) {
+            u[col_row[j]] += delta;
+            v[j] -= delta;
+          } else {
+            minv[j] -= delta;
+          }
+        }
+        j0 = j1;
+      } while (col_row[j0] != 0);
+      do {
+        const unsigned int j1 = way[j0];
+        col_row[j0] = col_row[j1];
+        j0 = j1;
+      } while (j0 != 0);
+    }
+
+    unsigned int num_matched = 0;
+    for (unsigned int j = 1; j <= n; j++) {
+      const unsigned int ireco = col_row[j] - 1;
+      const unsigned int igen = j - 1;
+      if (ireco < num_reco && igen < num_gen &&
+          dr2[ireco * num_gen + igen] < std::numeric_limits<float>::infinity()) {
+        matchidx[ireco] = static_cast<int>(igen);
+        num_matched++;
+      }
+    }
+    return num_matched;
+  }
+};
+
+// A grid of cells in (eta, phi) over the objects of one collection, e.g. the
+// PF candidates or the generator particles, such that the objects close to a
+// given direction are found without looping over the whole collection. The
+// phi cells wrap around, and the objects beyond +-max_eta are kept in the
+// outermost eta cells. The objects are sorted by cell, with the eta cells of
+// each phi cell stored contiguously, such that a query computes the
+// distances of one contiguous range per phi cell with simd::delta_r2.
+// build() reuses the buffers, such that rebuilding the grid in every event
+// does not allocate once they are large enough. The queries use a scratch
+// buffer of the grid, so a grid must not be queried from several threads.
+class EtaPhiGrid {
+ public:
+  EtaPhiGrid(float cell_size = 0.4f, float max_eta = 5.0f)
+      : num_eta(std::max(1, static_cast<int>(std::ceil(2.0f * max_eta / cell_size)))),
+        num_phi(std::max(1, static_cast<int>(2.0f * static_cast<float>(M_PI) / cell_size))),
+        eta_low(-max_eta),
+        eta_width(2.0f * max_eta / num_eta),
+        phi_width(2.0f * static_cast<float>(M_PI) / num_phi) {
+    if (!(cell_size > 0.0f) || !(max_eta > 0.0f)) {
+      throw std::runtime_error("EtaPhiGrid: cell_size and max_eta must be positive");
+    }
+  }
+
+  // Sorts the n objects into the cells, the indices returned by the queries
+  // refer to these arrays
+  void build(const float* eta, const float* phi, size_t n) {
+    cell_start.assign(num_eta * num_phi + 1, 0);
+    object_cell.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      object_cell[i] = phi_cell(phi[i]) * num_eta + eta_cell(eta[i]);
+      cell_start[object_cell[i] + 1]++;
+    }
+    for (unsigned int c = 0; c < num_eta * num_phi; c++) {
+      cell_start[c + 1] += cell_start[c];
+    }
+    sorted_index.resize(n);
+    sorted_eta.resize(n);
+    sorted_phi.resize(n);
+    scratch.resize(n);
+    // fill the cells from the back, such that each cell keeps the order of
+    // the objects
+    for (size_t i = n; i-- > 0;) {
+      const unsigned int k = --cell_start[object_cell[i] + 1];
+      sorted_index[k] = static_cast<unsigned int>(i);
+      sorted_eta[k] = eta[i];
+      sorted_phi[k] = phi[i];
+    }
+    // cell_start[c + 1] was decremented to the start of cell c
+    for (unsigned int c = 0; c < num_eta * num_phi; c++) {
+      cell_start[c] = cell_start[c + 1];
+    }
+    cell_start[num_eta * num_phi] = static_cast<unsigned int>(n);
+  }
+
+  template <typename Schema>
+  void build(const Collection<Schema>& objects) {
+    build(objects.eta.data(), objects.phi.data(), objects.size());
+  }
+
+  inline size_t size() const { return sorted_index.size(); }
+
+  // Calls f(index, dr2) for every object with deltaR < dr to (eta, phi), in
+  // no particular order
+  template <class F>
+  void for_each_within(float eta, float phi, float dr, F f) const {
+    const float pi = static_cast<float>(M_PI);
+    const float dr2 = dr * dr;
+    // the cells are searched with a small margin, such that rounding cannot
+    // miss an object on a cell boundary
+    const float reach = dr * 1.0001f + 1e-5f;
+    const int eta0 = eta_cell(eta - reach);
+    const int eta1 = eta_cell(eta + reach);
+    int phi0 = 0;
+    int phi1 = num_phi - 1;
+    if (reach < pi) {
+      phi0 = static_cast<int>(std::floor((phi - reach + pi) / phi_width));
+      phi1 = static_cast<int>(std::floor((phi + reach + pi) / phi_width));
+      if (phi1 - phi0 + 1 >= static_cast<int>(num_phi)) {
+        phi0 = 0;
+        phi1 = num_phi - 1;
+      }
+    }
+    for (int ip = phi0; ip <= phi1; ip++) {
+      const unsigned int iphi = (ip % static_cast<int>(num_phi) + num_phi) % num_phi;
+      const unsigned int begin = cell_start[iphi * num_eta + eta0];
+      const unsigned int end = cell_start[iphi * num_eta + eta1 + 1];
+      simd::delta_r2(eta, phi, sorted_eta.data() + begin, sorted_phi.data() + begin,
+                     end - begin, scratch.data() + begin);
+      for (unsigned int k = begin; k < end; k++) {
+        if (scratch[k] < dr2) {
+          f(sorted_index[k], scratch[k]);
+        }
+      }
+    }
+  }
+
+  // Writes the indices of the objects with deltaR < dr to (eta, phi) to out,
+  // sorted by index, and returns their number
+  size_t within(float eta, float phi, float dr, vector<unsigned int>& out) const {
+    out.clear();
+    for_each_within(eta, phi, dr, [&](unsigned int i, float) { out.push_back(i); });
+    std::sort(out.begin(), out.end());
+    return out.size();
+  }
+
+  // The index of the object closest to (eta, phi) with deltaR < max_dr, -1 if
+  // there is none. Ties are broken by the index. The search radius starts at
+  // one cell and is doubled until an object is found within it.
+  int nearest(float eta, float phi,
+              float max_dr = std::numeric_limits<float>::infinity()) const {
+    float dr = std::min(std::max(eta_width, phi_width), max_dr);
+    while (true) {
+      // once every cell is searched, the last search goes up to max_dr
+      const bool all_cells = eta_cell(eta - dr) == 0 &&
+                             eta_cell(eta + dr) == static_cast<int>(num_eta) - 1 &&
+                             dr >= static_cast<float>(M_PI);
+      const bool last = !(dr < max_dr) || all_cells;
+      if (last) {
+        dr = max_dr;
+      }
+      int best = -1;
+      float best_dr2 = 0.0f;
+      for_each_within(eta, phi, dr, [&](unsigned int i, float dr2) {
+        if (best < 0 || dr2 < best_dr2 || (dr2 == best_dr2 && static_cast<int>(i) < best)) {
+          best = static_cast<int>(i);
+          best_dr2 = dr2;
+        }
+      });
+      if (best >= 0 || last) {
+        return best;
+      }
+      dr = std::min(2.0f * dr, max_dr);
+    }
+  }
+
+  // The sum of values[index] over the objects with min_dr <= deltaR < dr to
+  // (eta, phi), e.g. the isolation sum of the pt of the PF candidates around
+  // a muon, with min_dr as a veto cone for the muon itself
+  float cone_sum(float eta, float phi, float dr, const float* values,
+                 float min_dr = 0.0f) const {
+    const float min_dr2 = min_dr * min_dr;
+    float sum = 0.0f;
+    for_each_within(eta, phi, dr, [&](unsigned int i, float dr2) {
+      if (dr2 >= min_dr2) {
+        sum += values[i];
+      }
+    });
+    return sum;
+  }
+
+ private:
+  unsigned int num_eta;
+  unsigned int num_phi;
+  float eta_low;
+  float eta_width;
+  float phi_width;
+
+  // The objects of cell c = iphi * num_eta + ieta are
+  // sorted_*[cell_start[c]] ... sorted_*[cell_start[c + 1] - 1]
+  vector<unsigned int> cell_start;
+  vector<unsigned int> object_cell;
+  vector<unsigned int> sorted_index;
+  vector<float> sorted_eta;
+  vector<float> sorted_phi;
+  mutable vector<float> scratch;
+
+  inline int eta_cell(float eta) const {
+    const float x = (eta - eta_low) / eta_width;
+    // clamp before converting, this also takes care of NaN
+    if (!(x >= 0.0f)) {
+      return 0;
+    } else if (!(x < num_eta)) {
+      return num_eta - 1;
+    }
+    return static_cast<int>(x);
+  }
+
+  inline unsigned int phi_cell(float phi) const {
+    const float x = (phi + static_cast<float>(M_PI)) / phi_width;
+    if (!std::isfinite(x)) {
+      return 0;
+    } else if (!(x >= 0.0f && x < num_phi)) {
+      // wrap the angles outside of [-pi, pi), e.g. exactly pi
+      const int k = static_cast<int>(std::floor(x));
+      return ((k % static_cast<int>(num_phi)) + num_phi) % num_phi;
+    }
+    return static_cast<unsigned int>(x);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                             BATCHED DATA ACCESS                           //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// A simple bump allocator. Memory is handed out from large blocks and is
+// never freed individually, instead reset() makes all of it available again,
+// e.g. at the start of each batch. After a reset, the memory handed out so far
+// must not be used anymore.
+class Arena {
+ public:
+  // All allocations are aligned to this, which is enough for AVX-512
+  static const size_t alignment = 64;
+
+  Arena(size_t _block_size = 1 << 20)
+      : block_size(_block_size), current_block(0), offset(0) {}
+
+  // Disallow copies, as the allocated memory belongs to one arena
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* allocate(size_t nbytes) {
+    nbytes = (nbytes + alignment - 1) / alignment * alignment;
+    while (current_block < blocks.size()) {
+      if (offset + nbytes <= blocks[current_block].size) {
+        void* ret = blocks[current_block].data + offset;
+        offset += nbytes;
+        return ret;
+      }
+      current_block += 1;
+      offset = 0;
+    }
+    add_block(std::max(block_size, nbytes));
+    offset = nbytes;
+    return blocks[current_block].data;
+  }
+
+  template <typename T>
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocate(n * sizeof(T)));
+  }
+
+  // Makes all the memory available again. If the memory did not fit in one
+  // block, the blocks are merged to one large block, such that in the steady
+  // state all allocations come from a single block.
+  void reset() {
+    if (blocks.size() > 1) {
+      size_t total = 0;
+      for (const auto& block : blocks) {
+        total += block.size;
+      }
+      blocks.clear();
+      add_block(total);
+    }
+    current_block = 0;
+    offset = 0;
+  }
+
+  // The total memory held by the arena in bytes
+  size_t capacity() const {
+    size_t total = 0;
+    for (const auto& block : blocks) {
+      total += block.size;
+    }
+    return total;
+  }
+
+ private:
+  struct Block {
+    unique_ptr<char[]> memory;
+    char* data;
+    size_t size;
+  };
+
+  void add_block(size_t nbytes) {
+    Block block;
+    block.memory.reset(new char[nbytes + alignment]);
+    const auto addr = reinterpret_cast<uintptr_t>(block.memory.get());
+    block.data = block.memory.get() + (alignment - addr % alignment) % alignment;
+    block.size = nbytes;
+    blocks.push_back(std::move(block));
+    current_block = blocks.size() - 1;
+  }
+
+  size_t block_size;
+  vector<Block> blocks;
+  size_t current_block;
+  size_t offset;
+};
+
+// A column of variable-length arrays across many events, e.g. Muon_pt[nMuon]
+// The arrays of all the events are stored contiguously in content, such that
+// the array of event iev is content[offsets[iev]] ... content[offsets[iev+1]-1]
+// The memory comes from an Arena, therefore the JaggedArray must be cleared
+// whenever the arena is reset. Only trivially copyable types are supported.
+template <typename T>
+class JaggedArray {
+ public:
+  Arena& arena;
+
+  T* content;
+  size_t content_size;
+  size_t content_capacity;
+
+  // offsets has num_events + 1 entries, offsets[0] = 0
+  unsigned int* offsets;
+  size_t num_events;
+  size_t offsets_capacity;
+
+  JaggedArray(Arena& _arena) : arena(_arena) { clear(); }
+
+  // Removes all the data, needs to be called after the arena is reset. The
+  // offsets of an array without events are {0}, such that offsets_view and
+  // the kernels never see a null pointer.
+  void clear() {
+    content = nullptr;
+    content_size = 0;
+    content_capacity = 0;
+    offsets = nullptr;
+    num_events = 0;
+    offsets_capacity = 0;
+    grow(offsets, 0, offsets_capacity, 1);
+    offsets[0] = 0;
+  }
+
+  // Preallocates the memory for the given number of events and elements
+  void reserve(size_t _num_events, size_t _content_size) {
+    if (_num_events + 1 > offsets_capacity) {
+      grow(offsets, num_events + 1, offsets_capacity, _num_events + 1);
+    }
+    if (_content_size > content_capacity) {
+      grow(content, content_size, content_capacity, _content_size);
+    }
+  }
+
+  // Appends the array of one event
+  void push_back(const T* data, size_t n) {
+    if (num_events + 2 > offsets_capacity) {
+      grow(offsets, num_events + 1, offsets_capacity, std::max(2 * offsets_capacity, size_t(16)));
+    }
+    if (content_size + n > content_capacity) {
+      grow(content, content_size, content_capacity,
+           std::max(2 * content_capacity, content_size + n));
+    }
+    std::copy(data, data + n, content + content_size);
+    content_size += n;
+    num_events += 1;
+    offsets[num_events] = content_size;
+  }
+
+  inline void push_back(const ArrayView<T>& arr) {
+    push_back(arr.data(), arr.size());
+  }
+
+  inline void push_back(TTreeReaderArray<T>& arr) {
+    const size_t n = arr.GetSize();
+    if (n > 0 && &arr.At(n - 1) == &arr.At(0) + (n - 1)) {
+      push_back(&arr.At(0), n);
+    } else {
+      const auto tmp = ROOT::VecOps::RVec<T>(arr.begin(), arr.end());
+      push_back(tmp.data(), tmp.size());
+    }
+  }
+
+  // The number of events
+  inline size_t size() const { return num_events; }
+
+  // The length of the array in event iev
+  inline unsigned int count(size_t iev) const {
+    return offsets[iev + 1] - offsets[iev];
+  }
+
+  // The array of event iev
+  inline ArrayView<T> operator[](size_t iev) const {
+    return ArrayView<T>(content + offsets[iev], count(iev));
+  }
+
+  // All the elements of all events
+  inline ArrayView<T> flatten() const {
+    return ArrayView<T>(content, content_size);
+  }
+
+  inline ArrayView<unsigned int> offsets_view() const {
+    return ArrayView<unsigned int>(offsets, num_events + 1);
+  }
+
+  // The length of the array in each event, allocated from the arena
+  ArrayView<unsigned int> counts() const {
+    auto* ret = arena.allocate<unsigned int>(num_events);
+    for (size_t iev = 0; iev < num_events; iev++) {
+      ret[iev] = count(iev);
+    }
+    return ArrayView<unsigned int>(ret, num_events);
+  }
+
+  // For each element, the index of the event it belongs to
+  ArrayView<unsigned int> parents() const {
+    auto* ret = arena.allocate<unsigned int>(content_size);
+    for (size_t iev = 0; iev < num_events; iev++) {
+      for (unsigned int i = offsets[iev]; i < offsets[iev + 1]; i++) {
+        ret[i] = iev;
+      }
+    }
+    return ArrayView<unsigned int>(ret, content_size);
+  }
+
+  // For each element, its index within its event
+  ArrayView<unsigned int> local_index() const {
+    auto* ret = arena.allocate<unsigned int>(content_size);
+    for (size_t iev = 0; iev < num_events; iev++) {
+      for (unsigned int i = offsets[iev]; i < offsets[iev + 1]; i++) {
+        ret[i] = i - offsets[iev];
+      }
+    }
+    return ArrayView<unsigned int>(ret, content_size);
+  }
+
+ private:
+  // Moves the data to a larger allocation from the arena, the old memory is
+  // reclaimed when the arena is reset
+  template <typename U>
+  void grow(U*& data, size_t used, size_t& capacity, size_t new_capacity) {
+    auto* new_data = arena.allocate<U>(new_capacity);
+    if (data != nullptr) {
+      std::copy(data, data + used, new_data);
+    }
+    data = new_data;
+    capacity = new_capacity;
+  }
+};
+
+// Wrappers of the vectorized kernels in nanoflow_simd.h for JaggedArrays
+// The results are allocated from the arena of the input array and are
+// therefore valid until the arena is reset.
+
+// The sum of the elements in each event
+static inline ArrayView<float> segmented_sum(const JaggedArray<float>& arr) {
+  auto* out = arr.arena.allocate<float>(arr.size());
+  simd::segmented_sum(arr.content, arr.offsets, arr.size(), out);
+  return ArrayView<float>(out, arr.size());
+}
+
+// The maximum element in each event, empty_value for empty events
+static inline ArrayView<float> segmented_max(
+    const JaggedArray<float>& arr,
+    float empty_value = -std::numeric_limits<float>::infinity()) {
+  auto* out = arr.arena.allocate<float>(arr.size());
+  simd::segmented_max(arr.content, arr.offsets, arr.size(), out, empty_value);
+  return ArrayView<float>(out, arr.size());
+}
+
+// The index of the maximum element in each event, -1 for empty events
+static inline ArrayView<int> segmented_argmax(const JaggedArray<float>& arr) {
+  auto* out = arr.arena.allocate<int>(arr.size());
+  simd::segmented_argmax(arr.content, arr.offsets, arr.size(), out);
+  return ArrayView<int>(out, arr.size());
+}
+
+// A mask over all the elements of all events, e.g. for pt > 20 use
+// compare(pt, simd::Cmp::Greater, 20), and for |eta| < 2.4 use
+// compare(eta, simd::Cmp::Less, 2.4, true). Masks can be combined using
+// simd::mask_and and simd::mask_or.
+static inline ArrayView<uint8_t> compare(const JaggedArray<float>& arr,
+                                         simd::Cmp op, float threshold,
+                                         bool use_abs = false) {
+  auto* out = arr.arena.allocate<uint8_t>(arr.content_size);
+  simd::compare(arr.content, arr.content_size, op, threshold, out, use_abs);
+  return ArrayView<uint8_t>(out, arr.content_size);
+}
+
+// Combines two masks element-wise, the result is allocated from the arena
+static inline ArrayView<uint8_t> mask_and(const ArrayView<uint8_t>& a,
+                                          const ArrayView<uint8_t>& b,
+                                          Arena& arena) {
+  auto* out = arena.allocate<uint8_t>(a.size());
+  simd::mask_and(a.data(), b.data(), a.size(), out);
+  return ArrayView<uint8_t>(out, a.size());
+}
+
+static inline ArrayView<uint8_t> mask_or(const ArrayView<uint8_t>& a,
+                                         const ArrayView<uint8_t>& b,
+                                         Arena& arena) {
+  auto* out = arena.allocate<uint8_t>(a.size());
+  simd::mask_or(a.data(), b.data(), a.size(), out);
+  return ArrayView<uint8_t>(out, a.size());
+}
+
+// The number of selected elements in each event
+static inline ArrayView<unsigned int> segmented_count(
+    const JaggedArray<float>& arr, const ArrayView<uint8_t>& mask) {
+  auto* out = arr.arena.allocate<unsigned int>(arr.size());
+  simd::segmented_count(mask.data(), arr.offsets, arr.size(), out);
+  return ArrayView<unsigned int>(out, arr.size());
+}
+
+// Fills out with the selected elements of arr, keeping the event structure
+static inline void compact(const JaggedArray<float>& arr,
+                           const ArrayView<uint8_t>& mask,
+                           JaggedArray<float>& out) {
+  out.clear();
+  out.reserve(arr.size(), arr.content_size);
+  out.content_size = simd::compact_jagged(arr.content, arr.offsets, arr.size(),
+                                          mask.data(), out.content, out.offsets);
+  out.num_events = arr.size();
+}
+
+// A column of a batch of events, filled one event at a time from the
+// TTreeReader
+class BatchColumnBase {
+ public:
+  const string name;
+
+  BatchColumnBase(const string& _name) : name(_name) {}
+  virtual ~BatchColumnBase() {}
+
+  // Removes the data of the previous batch, keeping the allocated memory
+  virtual void clear() = 0;
+
+  // Appends the data of the current TTreeReader entry
+  virtual void fill() = 0;
+};
+
+// A column of numbers, one per event, e.g. nMuon
+template <typename T>
+class ValueColumn : public BatchColumnBase {
+ public:
+  TTreeReaderValue<T> branch;
+  vector<T> content;
+
+  ValueColumn(TTreeReader& reader, const string& _name)
+      : BatchColumnBase(_name), branch(reader, _name.c_str()) {}
+
+  virtual void clear() override { content.clear(); }
+
+  virtual void fill() override { content.push_back(*branch); }
+
+  inline size_t size() const { return content.size(); }
+  inline T operator[](size_t iev) const { return content[iev]; }
+  inline const T* data() const { return content.data(); }
+};
+
+// A column of arrays, e.g. Muon_pt[nMuon], stored as a JaggedArray in the
+// arena of the batch
+template <typename T>
+class ArrayColumn : public BatchColumnBase, public JaggedArray<T> {
+ public:
+  TTreeReaderArray<T> branch;
+
+  ArrayColumn(TTreeReader& reader, Arena& arena, const string& _name)
+      : BatchColumnBase(_name),
+        JaggedArray<T>(arena),
+        branch(reader, _name.c_str()) {}
+
+  virtual void clear() override { JaggedArray<T>::clear(); }
+
+  virtual void fill() override { this->push_back(branch); }
+};
+
+// A batch of consecutive events from the TTree, e.g. a TTree cluster, stored
+// column-wise. Derived classes declare the needed columns in their
+// constructor using add_value and add_array, in the same way as the event
+// content is predefined in a NanoEvent.
+class EventBatch {
+ public:
+  TTreeReader& reader;
+
+  // The memory of the array columns, reused for every batch. Analyzers can
+  // also allocate temporary per-batch arrays here.
+  Arena arena;
+
+  vector<unique_ptr<BatchColumnBase>> columns;
+
+  // The TTree entries in this batch, [first_entry, first_entry + num_events)
+  long long first_entry;
+  unsigned int num_events;
+
+  EventBatch(TTreeReader& _reader)
+      : reader(_reader), first_entry(0), num_events(0) {}
+  virtual ~EventBatch() {}
+
+  template <typename T>
+  ValueColumn<T>& add_value(const string& name) {
+    auto* col = new ValueColumn<T>(reader, name);
+    columns.push_back(unique_ptr<BatchColumnBase>(col));
+    return *col;
+  }
+
+  template <typename T>
+  ArrayColumn<T>& add_array(const string& name) {
+    auto* col = new ArrayColumn<T>(reader, arena, name);
+    columns.push_back(unique_ptr<BatchColumnBase>(col));
+    return *col;
+  }
+
+  // Reads the TTree entries [begin, end) to the columns
+  void read(long long begin, long long end) {
+    arena.reset();
+    for (auto& col : columns) {
+      col->clear();
+    }
+    first_entry = begin;
+    num_events = 0;
+    for (long long entry = begin; entry < end; entry++) {
+      if (reader.SetEntry(entry) != TTreeReader::kEntryValid) {
+        throw std::runtime_error("EventBatch::read(): could not read entry " + to_string(entry));
+      }
+      for (auto& col : columns) {
+        col->fill();
+      }
+      num_events += 1;
+    }
+  }
+
+  // Computes batch-level quantities after the columns are read, similar to
+  // NanoEvent::analyze
+  virtual void analyze() {}
+};
+
+// This is here to verify the string hashing at compile time
+static_assert(string_hash("Jet_pt") == 8793984523732519589ULL,
+              "compile-time string hashing failed");
+
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                               HISTOGRAMS                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// The binning of a histogram axis, either nbins uniform bins in [low, high)
+// or variable bins given by their nbins + 1 edges. The bins are numbered as in
+// ROOT: 0 is the underflow, 1 ... nbins the bins and nbins + 1 the overflow.
+class Axis {
+ public:
+  int nbins;
+  double low;
+  double high;
+  // the bin edges for variable binning, empty for uniform binning
+  vector<double> edges;
+
+  Axis(int _nbins, double _low, double _high) : nbins(_nbins), low(_low), high(_high) {
+    if (nbins <= 0 || !(low < high)) {
+      throw std::runtime_error("Axis: need at least one bin and low < high");
+    }
+  }
+
+  Axis(const vector<double>& _edges) : edges(_edges) {
+    if (edges.size() < 2 || !std::is_sorted(edges.begin(), edges.end()) ||
+        std::adjacent_find(edges.begin(), edges.end()) != edges.end()) {
+      throw std::runtime_error("Axis: the bin edges must be strictly increasing");
+    }
+    nbins = static_cast<int>(edges.size()) - 1;
+    low = edges.front();
+    high = edges.back();
+  }
+
+  inline bool is_uniform() const { return edges.empty(); }
+
+  bool operator==(const Axis& other) const {
+    return nbins == other.nbins && low == other.low && high == other.high &&
+           edges == other.edges;
+  }
+
+  bool operator!=(const Axis& other) const { return !(*this == other); }
+
+  // The bin of a value, the same as TAxis::FindBin
+  inline int find_bin(double x) const {
+    if (is_uniform()) {
+      return simd::scalar::uniform_bin(x, nbins, low, high);
+    }
+    if (!(x < high)) {
+      return nbins + 1;
+    }
+    return static_cast<int>(std::upper_bound(edges.begin(), edges.end(), x) - edges.begin());
+  }
+
+  // The bins of n values. For uniform binning, the bins are computed
+  // arithmetically with the vectorized kernel, variable bins need a binary
+  // search per value.
+  void find_bins(const float* x, size_t n, int* out) const {
+    if (is_uniform()) {
+      simd::uniform_bins(x, n, nbins, low, high, out);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = find_bin(x[i]);
+      }
+    }
+  }
+};
+
+// A one-dimensional histogram with the sum of weights and the sum of squared
+// weights per bin. Filling it is a lot cheaper than filling a TH1D: there is
+// no virtual call and the bins of a whole array of values are found with a
+// vectorized kernel in fill_batch. It is converted to a TH1D with to_root(),
+// which Output does when the file is closed.
+class Histogram1D {
+ public:
+  string name;
+  string title;
+  Axis axis;
+
+  // nbins + 2 entries, including the underflow and overflow bins
+  vector<double> sumw;
+  vector<double> sumw2;
+
+  // The statistics of TH1: the number of entries, and the sums of w, w^2, w*x
+  // and w*x^2 over the values within the axis range
+  double entries;
+  double tsumw;
+  double tsumw2;
+  double tsumwx;
+  double tsumwx2;
+
+  Histogram1D(const string& _name, const Axis& _axis, const string& _title = "")
+      : name(_name),
+        title(_title.empty() ? _name : _title),
+        axis(_axis),
+        sumw(_axis.nbins + 2, 0.0),
+        sumw2(_axis.nbins + 2, 0.0) {
+    reset();
+  }
+
+  void reset() {
+    std::fill(sumw.begin(), sumw.end(), 0.0);
+    std::fill(sumw2.begin(), sumw2.end(), 0.0);
+    entries = 0.0;
+    tsumw = tsumw2 = tsumwx = tsumwx2 = 0.0;
+  }
+
+  inline void fill(double x, double w = 1.0) {
+    const int bin = axis.find_bin(x);
+    sumw[bin] += w;
+    sumw2[bin] += w * w;
+    entries += 1.0;
+    if (bin >= 1 && bin <= axis.nbins) {
+      tsumw += w;
+      tsumw2 += w * w;
+      tsumwx += w * x;
+      tsumwx2 += w * x * x;
+    }
+  }
+
+  // Fills n values with the given weights, or with weight 1 if weights is
+  // nullptr. The result is the same as calling fill() for each value.
+  void fill_batch(const float* values, const float* weights, size_t n) {
+    bins.resize(n);
+    axis.find_bins(values, n, bins.data());
+    for (size_t i = 0; i < n; i++) {
+      const double x = values[i];
+      const double w = weights != nullptr ? weights[i] : 1.0;
+      const int bin = bins[i];
+      sumw[bin] += w;
+      sumw2[bin] += w * w;
+      if (bin >= 1 && bin <= axis.nbins) {
+        tsumw += w;
+        tsumw2 += w * w;
+        tsumwx += w * x;
+        tsumwx2 += w * x * x;
+      }
+    }
+    entries += n;
+  }
+
+  void fill_batch(const vector<float>& values, const vector<float>& weights = {}) {
+    if (!weights.empty() && weights.size() != values.size()) {
+      throw std::runtime_error("Histogram1D::fill_batch(): " + name + " got " +
+                               to_string(values.size()) + " values and " +
+                               to_string(weights.size()) + " weights");
+    }
+    fill_batch(values.data(), weights.empty() ? nullptr : weights.data(), values.size());
+  }
+
+  void add(const Histogram1D& other) {
+    if (axis != other.axis) {
+      throw std::runtime_error("Histogram1D::add(): " + name + " and " +
+                               other.name + " have different binning");
+    }
+    for (size_t i = 0; i < sumw.size(); i++) {
+      sumw[i] += other.sumw[i];
+      sumw2[i] += other.sumw2[i];
+    }
+    entries += other.entries;
+    tsumw += other.tsumw;
+    tsumw2 += other.tsumw2;
+    tsumwx += other.tsumwx;
+    tsumwx2 += other.tsumwx2;
+  }
+
+  // Creates a TH1D with the same contents, errors and statistics. The TH1D
+  // is created in the current ROOT directory.
+  TH1D* to_root() const {
+    TH1D* hist = axis.is_uniform()
+                     ? new TH1D(name.c_str(), title.c_str(), axis.nbins, axis.low, axis.high)
+                     : new TH1D(name.c_str(), title.c_str(), axis.nbins, axis.edges.data());
+    hist->Sumw2();
+    for (int bin = 0; bin < axis.nbins + 2; bin++) {
+      hist->SetBinContent(bin, sumw[bin]);
+      hist->GetSumw2()->fArray[bin] = sumw2[bin];
+    }
+    double stats[4] = {tsumw, tsumw2, tsumwx, tsumwx2};
+    hist->PutStats(stats);
+    hist->SetEntries(entries);
+    return hist;
+  }
+
+ private:
+  // the bins of the values in fill_batch, kept to avoid allocations
+  vector<int> bins;
+};
+
+// A two-dimensional histogram, see Histogram1D. The bin (ix, iy) is stored at
+// ix + (nx + 2) * iy, as in TH2.
+class Histogram2D {
+ public:
+  string name;
+  string title;
+  Axis xaxis;
+  Axis yaxis;
+
+  // (nx + 2) * (ny + 2) entries, including the underflow and overflow bins
+  vector<double> sumw;
+  vector<double> sumw2;
+
+  // The statistics of TH2: the number of entries, and the sums of w, w^2,
+  // w*x, w*x^2, w*y, w*y^2 and w*x*y over the values within the axis ranges
+  double entries;
+  double tsumw;
+  double tsumw2;
+  double tsumwx;
+  double tsumwx2;
+  double tsumwy;
+  double tsumwy2;
+  double tsumwxy;
+
+  Histogram2D(const string& _name, const Axis& _xaxis, const Axis& _yaxis,
+              const string& _title = "")
+      : name(_name),
+        title(_title.empty() ? _name : _title),
+        xaxis(_xaxis),
+        yaxis(_yaxis),
+        sumw((_xaxis.nbins + 2) * (_yaxis.nbins + 2), 0.0),
+        sumw2((_xaxis.nbins + 2) * (_yaxis.nbins + 2), 0.0) {
+    reset();
   }
 
-  // Retrieves an int from the object
-  Int_t get_int(const unsigned int string_hash) const {
-    return event->lc_vint.get(string_hash, index);
+  void reset() {
+    std::fill(sumw.begin(), sumw.end(), 0.0);
+    std::fill(sumw2.begin(), sumw2.end(), 0.0);
+    entries = 0.0;
+    tsumw = tsumw2 = tsumwx = tsumwx2 = tsumwy = tsumwy2 = tsumwxy = 0.0;
+  }
+
+  inline void fill(double x, double y, double w = 1.0) {
+    const int binx = xaxis.find_bin(x);
+    const int biny = yaxis.find_bin(y);
+    accumulate(binx, biny, x, y, w);
+    entries += 1.0;
+  }
+
+  // Fills n pairs of values, with weight 1 if weights is nullptr
+  void fill_batch(const float* xvalues, const float* yvalues, const float* weights,
+                  size_t n) {
+    xbins.resize(n);
+    ybins.resize(n);
+    xaxis.find_bins(xvalues, n, xbins.data());
+    yaxis.find_bins(yvalues, n, ybins.data());
+    for (size_t i = 0; i < n; i++) {
+      accumulate(xbins[i], ybins[i], xvalues[i], yvalues[i],
+                 weights != nullptr ? weights[i] : 1.0);
+    }
+    entries += n;
+  }
+
+  void fill_batch(const vector<float>& xvalues, const vector<float>& yvalues,
+                  const vector<float>& weights = {}) {
+    if (xvalues.size() != yvalues.size() ||
+        (!weights.empty() && weights.size() != xvalues.size())) {
+      throw std::runtime_error("Histogram2D::fill_batch(): " + name +
+                               " got arrays of different sizes");
+    }
+    fill_batch(xvalues.data(), yvalues.data(),
+               weights.empty() ? nullptr : weights.data(), xvalues.size());
+  }
+
+  void add(const Histogram2D& other) {
+    if (xaxis != other.xaxis || yaxis != other.yaxis) {
+      throw std::runtime_error("Histogram2D::add(): " + name + " and " +
+                               other.name + " have different binning");
+    }
+    for (size_t i = 0; i < sumw.size(); i++) {
+      sumw[i] += other.sumw[i];
+      sumw2[i] += other.sumw2[i];
+    }
+    entries += other.entries;
+    tsumw += other.tsumw;
+    tsumw2 += other.tsumw2;
+    tsumwx += other.tsumwx;
+    tsumwx2 += other.tsumwx2;
+    tsumwy += other.tsumwy;
+    tsumwy2 += other.tsumwy2;
+    tsumwxy += other.tsumwxy;
+  }
+
+  // Creates a TH2D with the same contents, errors and statistics in the
+  // current ROOT directory
+  TH2D* to_root() const {
+    TH2D* hist = nullptr;
+    if (xaxis.is_uniform() && yaxis.is_uniform()) {
+      hist = new TH2D(name.c_str(), title.c_str(), xaxis.nbins, xaxis.low, xaxis.high,
+                      yaxis.nbins, yaxis.low, yaxis.high);
+    } else {
+      const auto xedges = get_edges(xaxis);
+      const auto yedges = get_edges(yaxis);
+      hist = new TH2D(name.c_str(), title.c_str(), xaxis.nbins, xedges.data(),
+                      yaxis.nbins, yedges.data());
+    }
+    hist->Sumw2();
+    for (int bin = 0; bin < static_cast<int>(sumw.size()); bin++) {
+      hist->SetBinContent(bin, sumw[bin]);
+      hist->GetSumw2()->fArray[bin] = sumw2[bin];
+    }
+    double stats[7] = {tsumw, tsumw2, tsumwx, tsumwx2, tsumwy, tsumwy2, tsumwxy};
+    hist->PutStats(stats);
+    hist->SetEntries(entries);
+    return hist;
+  }
+
+ private:
+  vector<int> xbins;
+  vector<int> ybins;
+
+  inline void accumulate(int binx, int biny, double x, double y, double w) {
+    const int bin = binx + (xaxis.nbins + 2) * biny;
+    sumw[bin] += w;
+    sumw2[bin] += w * w;
+    if (binx >= 1 && binx <= xaxis.nbins && biny >= 1 && biny <= yaxis.nbins) {
+      tsumw += w;
+      tsumw2 += w * w;
+      tsumwx += w * x;
+      tsumwx2 += w * x * x;
+      tsumwy += w * y;
+      tsumwy2 += w * y * y;
+      tsumwxy += w * x * y;
+    }
   }
 
+  // The edges of an axis, also for uniform binning
+  static vector<double> get_edges(const Axis& axis) {
+    if (!axis.is_uniform()) {
+      return axis.edges;
+    }
+    vector<double> edges(axis.nbins + 1);
+    for (int i = 0; i <= axis.nbins; i++) {
+      edges[i] = axis.low + i * (axis.high - axis.low) / axis.nbins;
+    }
+    return edges;
+  }
 };
 
-// This is here to verify the string hashing at compile time
-static_assert(string_hash("Jet_pt") == 1724548869,
-              "compile-time string hashing failed");
+// A buffer of an analyzer that is stored in a branch of an output TTree, see
+// TreeAnalyzer::branch. The owner of the buffer keeps it up to date with
+// set_buffer if the buffer moves or its used size changes.
+class OutputBranch {
+ public:
+  string name;
+  TBranch* branch;
+  // the values of the current event
+  const char* data;
+  // the number of bytes of the current event
+  size_t num_bytes;
+  // the size of the buffer at data
+  size_t capacity_bytes;
+  // true if the branch points to the buffers of an AsyncTreeWriter instead
+  bool async;
+
+  OutputBranch(const string& _name, TBranch* _branch, const char* _data,
+               size_t _num_bytes, size_t _capacity_bytes)
+      : name(_name),
+        branch(_branch),
+        data(_data),
+        num_bytes(_num_bytes),
+        capacity_bytes(_capacity_bytes),
+        async(false) {}
+
+  // Points the branch to a buffer that has moved, and sets the number of
+  // bytes of the current event
+  inline void set_buffer(const char* _data, size_t _num_bytes, size_t _capacity_bytes) {
+    if (_data != data && !async) {
+      branch->SetAddress(const_cast<char*>(_data));
+    }
+    data = _data;
+    num_bytes = _num_bytes;
+    capacity_bytes = _capacity_bytes;
+  }
+};
+
+// A variable-length array that is stored in a branch of an output TTree, e.g.
+// the px of the muons of an event, see TreeAnalyzer::branch. The buffer grows
+// as needed, in which case the branch is pointed to the new buffer, such that
+// no objects need to be dropped. Only the used elements are cleared.
+template <typename T>
+class OutputColumn {
+ public:
+  OutputColumn(size_t capacity = 16)
+      : buffer(std::max(capacity, size_t(1))), num(0), out_branch(nullptr) {}
+
+  inline size_t size() const { return num; }
+  inline size_t capacity() const { return buffer.size(); }
+  inline T* data() { return buffer.data(); }
+  inline const T* data() const { return buffer.data(); }
+
+  inline T& operator[](size_t idx) { return buffer[idx]; }
+  inline const T& operator[](size_t idx) const { return buffer[idx]; }
+
+  // Sets the number of elements, the new elements are zero
+  inline void resize(size_t n) {
+    if (n > buffer.size()) {
+      buffer.resize(std::max(n, 2 * buffer.size()));
+    } else if (n < num) {
+      std::fill(buffer.begin() + n, buffer.begin() + num, T());
+    }
+    num = n;
+    update_branch();
+  }
+
+  inline void push_back(const T& value) {
+    if (num == buffer.size()) {
+      buffer.resize(2 * buffer.size());
+    }
+    buffer[num++] = value;
+    update_branch();
+  }
+
+  inline void clear() { resize(0); }
+
+  // Connects the column to its branch, done by TreeAnalyzer::branch
+  void set_branch(OutputBranch* _out_branch) {
+    out_branch = _out_branch;
+    update_branch();
+  }
+
+ private:
+  // The elements after the first num are always zero
+  vector<T> buffer;
+  size_t num;
+  OutputBranch* out_branch;
+
+  inline void update_branch() {
+    if (out_branch != nullptr) {
+      out_branch->set_buffer(reinterpret_cast<const char*>(buffer.data()),
+                             num * sizeof(T), buffer.size() * sizeof(T));
+    }
+  }
+};
+
+// Fills a TTree in a background thread, such that the basket compression and
+// the writing to disk do not stall the event loop. The event loop copies the
+// buffers of the branches to the next free record of a ring of pre-allocated
+// records with push(), and the writer thread copies the records to its own
+// buffers, to which the branches point, and calls TTree::Fill. The event loop
+// only waits if all the records are in use.
+// With ROOT implicit multithreading enabled, TTree::Fill compresses the
+// baskets of the different branches in parallel.
+class AsyncTreeWriter {
+ public:
+  TTree* tree;
 
+  // The time the event loop waited for a free record, in nanoseconds
+  unsigned long long wait_duration;
+  unsigned long long num_filled;
+
+  AsyncTreeWriter(TTree* _tree, const vector<OutputBranch*>& _branches,
+                  size_t num_records)
+      : tree(_tree),
+        wait_duration(0),
+        num_filled(0),
+        branches(_branches),
+        records(std::max(num_records, size_t(1))),
+        staging(_branches.size()),
+        head(0),
+        count(0),
+        stopping(false) {
+    ROOT::EnableThreadSafety();
+    for (auto& record : records) {
+      record.resize(branches.size());
+      for (unsigned int ibranch = 0; ibranch < branches.size(); ibranch++) {
+        record[ibranch].reserve(branches[ibranch]->capacity_bytes);
+      }
+    }
+    // The branches point to the buffers of the writer thread from here on
+    for (unsigned int ibranch = 0; ibranch < branches.size(); ibranch++) {
+      staging[ibranch].resize(std::max(branches[ibranch]->capacity_bytes, size_t(8)));
+      branches[ibranch]->async = true;
+    }
+    connect();
+    writer = std::thread(&AsyncTreeWriter::run, this);
+  }
+
+  ~AsyncTreeWriter() { stop(); }
+
+  // Copies the current contents of the branch buffers to the next free
+  // record, waits if all the records are in use
+  void push() {
+    size_t slot = 0;
+    {
+      unique_lock<mutex> lock(mtx);
+      if (count == records.size()) {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        cv.wait(lock, [this]() { return count < records.size() || error; });
+        wait_duration += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::high_resolution_clock::now() - t0).count();
+      }
+      if (error) {
+        rethrow_exception(error);
+      }
+      slot = (head + count) % records.size();
+    }
+
+    // The writer thread does not touch the free records
+    auto& record = records[slot];
+    for (unsigned int ibranch = 0; ibranch < branches.size(); ibranch++) {
+      const auto* br = branches[ibranch];
+      record[ibranch].assign(br->data, br->data + br->num_bytes);
+    }
+
+    {
+      lock_guard<mutex> lock(mtx);
+      count += 1;
+    }
+    cv.notify_all();
+  }
+
+  // Waits until all the pushed records are filled to the TTree
+  void flush() {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this]() { return count == 0 || error; });
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+
+  // Points the branches to the buffers of the writer thread, e.g. after the
+  // addresses of the TTree were changed by Output::merge. Only called when
+  // no records are waiting, see flush.
+  void connect() {
+    for (unsigned int ibranch = 0; ibranch < branches.size(); ibranch++) {
+      branches[ibranch]->branch->SetAddress(staging[ibranch].data());
+    }
+  }
+
+  // Fills the remaining records and stops the writer thread
+  void close() {
+    stop();
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+
+ private:
+  vector<OutputBranch*> branches;
+
+  // records[i][ibranch] are the bytes of a branch in record i
+  vector<vector<vector<char>>> records;
+  // the buffers of the writer thread that the branches point to
+  vector<vector<char>> staging;
+
+  // the records [head, head + count) are waiting to be filled
+  size_t head;
+  size_t count;
+  bool stopping;
+  exception_ptr error;
+
+  mutex mtx;
+  condition_variable cv;
+  std::thread writer;
+
+  void stop() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stopping = true;
+    }
+    cv.notify_all();
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+  void run() {
+    while (true) {
+      size_t slot = 0;
+      {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]() { return count > 0 || stopping; });
+        if (count == 0) {
+          return;
+        }
+        slot = head;
+      }
+
+      try {
+        const auto& record = records[slot];
+        for (unsigned int ibranch = 0; ibranch < branches.size(); ibranch++) {
+          // A buffer that has grown needs a larger staging buffer
+          if (record[ibranch].size() > staging[ibranch].size()) {
+            staging[ibranch].resize(record[ibranch].size());
+            branches[ibranch]->branch->SetAddress(staging[ibranch].data());
+          }
+          std::copy(record[ibranch].begin(), record[ibranch].end(), staging[ibranch].begin());
+        }
+        tree->Fill();
+        num_filled += 1;
+      } catch (...) {
+        lock_guard<mutex> lock(mtx);
+        error = current_exception();
+        cv.notify_all();
+        return;
+      }
+
+      {
+        lock_guard<mutex> lock(mtx);
+        head = (head + 1) % records.size();
+        count -= 1;
+      }
+      cv.notify_all();
+    }
+  }
+};
 
 // A class that creates the output file and contains all the other
 // output objects: histograms, TTrees etc
@@ -321,8 +3042,42 @@ class Output {
   // However, for reasons of speed, we use a compile-time hash of the string
   // therefore, we only ever refer to the histogram by its hash, which is a
   // number
-  unordered_map<unsigned int, shared_ptr<TH1D>> histograms_1d;
-  unordered_map<unsigned int, shared_ptr<TTree>> trees;
+  unordered_map<HashKey, shared_ptr<TH1D>> histograms_1d;
+  unordered_map<HashKey, shared_ptr<TTree>> trees;
+
+  // The number of events that are buffered for each TTree writer thread, 0 to
+  // fill the TTrees in the event loop. The writers are started by the
+  // TreeAnalyzers, see start_writer.
+  size_t async_ring_size = 0;
+  unordered_map<HashKey, unique_ptr<AsyncTreeWriter>> writers;
+
+  // The buffers of the branches of the TTrees, see TreeAnalyzer::branch
+  unordered_map<HashKey, vector<unique_ptr<OutputBranch>>> tree_branches;
+
+  // The nanoflow histograms, see add_histogram_1d and add_histogram_2d.
+  // They are converted to TH1D and TH2D when the Output is closed.
+  unordered_map<HashKey, shared_ptr<Histogram1D>> hists_1d;
+  unordered_map<HashKey, shared_ptr<Histogram2D>> hists_2d;
+
+  // The histograms of one task in looper_main_mt and looper_files_mt
+  class HistogramShard {
+   public:
+    unordered_map<HashKey, shared_ptr<TH1D>> histograms_1d;
+    unordered_map<HashKey, shared_ptr<Histogram1D>> hists_1d;
+    unordered_map<HashKey, shared_ptr<Histogram2D>> hists_2d;
+  };
+
+  // The histograms filled by the threads in looper_main_mt and
+  // looper_files_mt, or by looper_main, with one shard per task, keyed by the
+  // task index.
+  // They are added to the histograms in the order of the task index when the
+  // Output is closed, such that the result does not depend on the number of
+  // threads, on which thread processed which task, or in which order the
+  // tasks were finished. looper_main moves its histograms to the shards of
+  // the same tasks, see TaskShards, so a single thread gives the same result.
+  map<unsigned long long, HistogramShard> histogram_shards;
+  unsigned long long num_shards = 0;
+  mutex shards_mtx;
 
   // Creates the output TFile
   Output(const string& outfn) {
@@ -331,12 +3086,292 @@ class Output {
     outfile->cd();
   }
 
+  // Creates an Output without a file, the objects are kept in memory
+  Output() {}
+
+  // Removes the temporary file of a thread Output, see make_thread_output
+  ~Output() {
+    if (temporary_filename.empty()) {
+      return;
+    }
+    // The TTrees and histograms remove themselves from the file when they are
+    // deleted, which has to happen before the file is closed
+    writers.clear();
+    trees.clear();
+    histograms_1d.clear();
+    outfile->Close();
+    outfile.reset();
+    std::remove(temporary_filename.c_str());
+  }
+
+  // Creates the Output of a worker thread in looper_main_mt and
+  // looper_files_mt. Its TTrees are written to a temporary file next to the
+  // output file until they are merged to this Output, such that the entries
+  // of the threads are not kept in memory. The file is removed when the
+  // thread Output is destroyed. The thread Output fills its TTrees in writer
+  // threads like this one, see async_ring_size.
+  unique_ptr<Output> make_thread_output(unsigned int ithread) const {
+    auto thread_output = make_unique<Output>();
+    thread_output->async_ring_size = async_ring_size;
+    if (outfile) {
+      thread_output->temporary_filename =
+          string(outfile->GetName()) + ".thread" + to_string(ithread) + ".tmp";
+      thread_output->outfile =
+          make_unique<TFile>(thread_output->temporary_filename.c_str(), "RECREATE");
+    }
+    return thread_output;
+  }
+
+  // Makes the output file the current directory, if there is one
+  void cd() {
+    if (outfile) {
+      outfile->cd();
+    }
+  }
+
+  // Stores a histogram or a TTree in the output file, or keeps it in memory
+  // if there is no file
+  template <typename T>
+  void attach(T* obj) {
+    obj->SetDirectory(outfile.get());
+  }
+
+  // Creates a histogram that is written to the output file as a TH1D when
+  // the Output is closed. The histogram is referred to by the hash of its
+  // name, e.g. get_histogram_1d(string_hash("muon_pt")).
+  Histogram1D& add_histogram_1d(const string& name, const Axis& axis,
+                                const string& title = "") {
+    const auto key = string_hash_cpp(name);
+    check_new_histogram(key, name, hists_1d);
+    hists_1d[key] = make_shared<Histogram1D>(name, axis, title);
+    return *hists_1d[key];
+  }
+
+  // Creates a histogram that is written as a TH2D when the Output is closed
+  Histogram2D& add_histogram_2d(const string& name, const Axis& xaxis,
+                                const Axis& yaxis, const string& title = "") {
+    const auto key = string_hash_cpp(name);
+    check_new_histogram(key, name, hists_2d);
+    hists_2d[key] = make_shared<Histogram2D>(name, xaxis, yaxis, title);
+    return *hists_2d[key];
+  }
+
+  Histogram1D& get_histogram_1d(HashKey key) { return *hists_1d.at(key); }
+
+  Histogram2D& get_histogram_2d(HashKey key) { return *hists_2d.at(key); }
+
+  // Starts a writer thread that fills the TTree from the given buffers
+  AsyncTreeWriter& start_writer(HashKey tree_key,
+                                const vector<OutputBranch*>& branches) {
+    if (writers.find(tree_key) != writers.end()) {
+      throw std::runtime_error("Output::start_writer(): the TTree already has a writer");
+    }
+    writers[tree_key] = make_unique<AsyncTreeWriter>(trees.at(tree_key).get(),
+                                                     branches, async_ring_size);
+    return *writers[tree_key];
+  }
+
+  // Waits until the writer threads have filled all the buffered events
+  void flush_writers() {
+    for (auto& kv : writers) {
+      kv.second->flush();
+    }
+  }
+
+  // Creates a branch of a TTree that stores a buffer of an analyzer
+  OutputBranch& add_branch(HashKey tree_key, const string& name, void* address,
+                           const string& leaflist, size_t num_bytes,
+                           size_t capacity_bytes) {
+    auto* branch = trees.at(tree_key)->Branch(name.c_str(), address, leaflist.c_str());
+    auto& branches = tree_branches[tree_key];
+    branches.push_back(make_unique<OutputBranch>(
+        name, branch, static_cast<const char*>(address), num_bytes, capacity_bytes));
+    return *branches.back();
+  }
+
+  // Adds the histograms and the TTree entries of another Output to this one.
+  // The TTrees must exist in both, as they are created by the analyzers.
+  void merge(Output& other) {
+    other.flush_writers();
+    flush_writers();
+    add_root_histograms(histograms_1d, other.histograms_1d);
+    add_histograms(hists_1d, other.hists_1d);
+    add_histograms(hists_2d, other.hists_2d);
+    for (auto& kv : other.trees) {
+      const auto it = trees.find(kv.first);
+      if (it == trees.end()) {
+        throw std::runtime_error("Output::merge(): a TTree does not exist in the output it is merged to");
+      }
+      copy_entries(kv.first, other, 0, kv.second->GetEntries());
+    }
+  }
+
+  // The number of entries of each TTree, including the events that are still
+  // buffered for the writer threads
+  unordered_map<HashKey, long long> tree_entries() {
+    flush_writers();
+    unordered_map<HashKey, long long> ret;
+    for (const auto& kv : trees) {
+      ret[kv.first] = kv.second->GetEntries();
+    }
+    return ret;
+  }
+
+  // Adds the entries [first[key], end[key]) of each TTree of another Output
+  // to this one, e.g. the entries that a thread filled for one task in
+  // looper_files_mt. The histograms are not merged.
+  void merge_entries(Output& other, const unordered_map<HashKey, long long>& first,
+                     const unordered_map<HashKey, long long>& end) {
+    other.flush_writers();
+    flush_writers();
+    for (const auto& kv : end) {
+      if (trees.find(kv.first) == trees.end()) {
+        throw std::runtime_error("Output::merge_entries(): a TTree does not exist in the output it is merged to");
+      }
+      const auto it = first.find(kv.first);
+      copy_entries(kv.first, other, it != first.end() ? it->second : 0, kv.second);
+    }
+  }
+
+  // Reserves num consecutive shard indices, returns the first one
+  unsigned long long reserve_shards(unsigned long long num) {
+    lock_guard<mutex> lock(shards_mtx);
+    const auto first = num_shards;
+    num_shards += num;
+    return first;
+  }
+
+  // Moves the histograms of a thread-local Output, or of this Output in
+  // looper_main, to the shard with the given index, leaving the histograms
+  // empty for the next task. The threads fill their own histograms without
+  // any locking, this is only called once per task.
+  void add_shard(unsigned long long index, Output& thread_output) {
+    HistogramShard shard;
+    for (auto& kv : thread_output.histograms_1d) {
+      auto* hist = static_cast<TH1D*>(kv.second->Clone());
+      hist->SetDirectory(nullptr);
+      shard.histograms_1d[kv.first] = shared_ptr<TH1D>(hist);
+      kv.second->Reset();
+    }
+    for (auto& kv : thread_output.hists_1d) {
+      shard.hists_1d[kv.first] = make_shared<Histogram1D>(*kv.second);
+      kv.second->reset();
+    }
+    for (auto& kv : thread_output.hists_2d) {
+      shard.hists_2d[kv.first] = make_shared<Histogram2D>(*kv.second);
+      kv.second->reset();
+    }
+    lock_guard<mutex> lock(shards_mtx);
+    histogram_shards[index] = std::move(shard);
+  }
+
+  // Adds the histogram shards to the histograms in the order of the shard index
+  void merge_shards() {
+    lock_guard<mutex> lock(shards_mtx);
+    for (auto& shard : histogram_shards) {
+      add_root_histograms(histograms_1d, shard.second.histograms_1d);
+      add_histograms(hists_1d, shard.second.hists_1d);
+      add_histograms(hists_2d, shard.second.hists_2d);
+    }
+    histogram_shards.clear();
+  }
+
   // makes sure the TFile is properly written and closed
   void close() {
+    if (!outfile) {
+      return;
+    }
+    merge_shards();
+
+    for (auto& kv : writers) {
+      kv.second->close();
+      cout << "Filled " << kv.second->num_filled << " entries to "
+           << kv.second->tree->GetName() << " in the writer thread, waited "
+           << kv.second->wait_duration / 1e9 << " s" << endl;
+    }
+    writers.clear();
+
+    // The ROOT histograms are owned by the file from here on
+    outfile->cd();
+    for (const auto& kv : hists_1d) {
+      attach(kv.second->to_root());
+    }
+    for (const auto& kv : hists_2d) {
+      attach(kv.second->to_root());
+    }
+
     cout << "Writing output to file " << outfile->GetPath() << endl;
     outfile->Write();
     outfile->Close();
   }
+
+ private:
+  // The file of a thread Output, see make_thread_output
+  string temporary_filename;
+
+  // Copies the entries [first, end) of a TTree of another Output to the same
+  // TTree here
+  void copy_entries(HashKey tree_key, Output& other, long long first, long long end) {
+    // Without CopyAddresses the entries would be read to the buffers of the
+    // other Output and the stale buffers here would be filled
+    auto* src_tree = other.trees.at(tree_key).get();
+    auto* dst_tree = trees.at(tree_key).get();
+    src_tree->CopyAddresses(dst_tree);
+    for (long long entry = first; entry < end; entry++) {
+      src_tree->GetEntry(entry);
+      dst_tree->Fill();
+    }
+    // Undoing CopyAddresses resets all the addresses of this TTree
+    src_tree->CopyAddresses(dst_tree, true);
+    for (auto& dst : tree_branches[tree_key]) {
+      dst->branch->SetAddress(const_cast<char*>(dst->data));
+    }
+    const auto writer = writers.find(tree_key);
+    if (writer != writers.end()) {
+      writer->second->connect();
+    }
+  }
+
+  template <class Hist>
+  static void check_new_histogram(HashKey key, const string& name,
+                                  const unordered_map<HashKey, shared_ptr<Hist>>& hists) {
+    const auto it = hists.find(key);
+    if (it == hists.end()) {
+      return;
+    }
+    if (it->second->name == name) {
+      throw std::runtime_error("Output: histogram " + name + " already exists");
+    }
+    throw std::runtime_error("Output: hash collision between the histograms " +
+                             name + " and " + it->second->name);
+  }
+
+  void add_root_histograms(unordered_map<HashKey, shared_ptr<TH1D>>& dst,
+                           const unordered_map<HashKey, shared_ptr<TH1D>>& src) {
+    for (const auto& kv : src) {
+      const auto it = dst.find(kv.first);
+      if (it != dst.end()) {
+        it->second->Add(kv.second.get());
+      } else {
+        auto* hist = static_cast<TH1D*>(kv.second->Clone());
+        attach(hist);
+        dst[kv.first] = shared_ptr<TH1D>(hist);
+      }
+    }
+  }
+
+  template <class Hist>
+  static void add_histograms(unordered_map<HashKey, shared_ptr<Hist>>& dst,
+                             const unordered_map<HashKey, shared_ptr<Hist>>& src) {
+    for (const auto& kv : src) {
+      const auto it = dst.find(kv.first);
+      if (it != dst.end()) {
+        it->second->add(*kv.second);
+      } else {
+        dst[kv.first] = make_shared<Hist>(*kv.second);
+      }
+    }
+  }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -351,9 +3386,47 @@ class Analyzer {
  public:
   virtual void analyze(NanoEvent& event) = 0;
   virtual const string getName() const = 0;
+
+  // Processes the event and returns false if the event should not be passed
+  // on to the following analyzers. By default, all events are kept.
+  virtual bool process(NanoEvent& event) {
+    analyze(event);
+    return true;
+  }
+
+  // Processes a batch of events in looper_batch, analyzers that are used in
+  // a batched loop need to implement this
+  virtual void analyze_batch(EventBatch& batch) {
+    throw std::runtime_error("Analyzer " + getName() + " does not implement analyze_batch()");
+  }
+
+  // Creates a new analyzer with the same settings that writes to the given
+  // Output, used to run the analysis in several threads in looper_main_mt
+  virtual Analyzer* clone(Output& output) const {
+    throw std::runtime_error("Analyzer " + getName() + " does not implement clone()");
+  }
+
+  virtual ~Analyzer() {}
+};
+
+// An Analyzer that selects events: the event loop stops processing an event
+// as soon as a filter rejects it, such that the branches that only the
+// following analyzers need are never read for rejected events.
+class FilterAnalyzer : public Analyzer {
+ public:
+  // Returns true if the event passes the selection
+  virtual bool filter(NanoEvent& event) = 0;
+
+  virtual void analyze(NanoEvent& event) override { filter(event); }
+
+  virtual bool process(NanoEvent& event) override { return filter(event); }
 };
 
 // This is an example of how to produce TTree outputs
+// The branches are declared with branch(), such that the TTree can be filled
+// in a writer thread if the Output has async_ring_size > 0, see
+// AsyncTreeWriter. Branches that are created with out_tree->Branch()
+// directly can only be filled in the event loop.
 class TreeAnalyzer : public Analyzer {
  public:
   Output& output;
@@ -365,17 +3438,41 @@ class TreeAnalyzer : public Analyzer {
   unsigned int br_luminosityBlock;
   unsigned long br_event;
 
-  TreeAnalyzer(Output& _output) : output(_output) {
-    output.outfile->cd();
+  TreeAnalyzer(Output& _output) : output(_output), writer(nullptr) {
+    output.cd();
     output.trees[string_hash("Events")] =
         make_shared<TTree>("Events", "Events");
     out_tree = output.trees.at(string_hash("Events"));
+    output.attach(out_tree.get());
+
+    branch("run", &br_run, "run/i");
+    branch("luminosityBlock", &br_luminosityBlock, "luminosityBlock/i");
+    branch("event", &br_event, "event/l");
+  }
+
+  // Creates a branch of the output TTree for a variable or a fixed-size
+  // array of num_elements values, e.g.
+  //   branch("nMuon", &nMuon, "nMuon/I");
+  //   branch("Jet_btag", Jet_btag.data(), "Jet_btag[nJet]/F", Jet_btag.size());
+  template <typename T>
+  OutputBranch& branch(const string& name, T* address, const string& leaflist,
+                       size_t num_elements = 1) {
+    auto& br = output.add_branch(string_hash("Events"), name, address, leaflist,
+                                 num_elements * sizeof(T), num_elements * sizeof(T));
+    branches.push_back(&br);
+    return br;
+  }
 
-    out_tree->Branch("run", &br_run, "run/i");
-    out_tree->Branch("luminosityBlock", &br_luminosityBlock, "luminosityBlock/i");
-    out_tree->Branch("event", &br_event, "event/l");
-    // out_tree.lock()->SetDirectory(output->outfile.get());
-    // cout << out_tree.lock()->GetName() << endl;
+  // Creates a branch of the output TTree for a variable-length array, e.g.
+  //   branch("Muon_px", Muon_px, "Muon_px[nMuon]/F");
+  // The length branch (nMuon) has to be set to the size of the column.
+  template <typename T>
+  OutputBranch& branch(const string& name, OutputColumn<T>& column, const string& leaflist) {
+    auto& br = output.add_branch(string_hash("Events"), name, column.data(), leaflist,
+                                 column.size() * sizeof(T), column.capacity() * sizeof(T));
+    column.set_branch(&br);
+    branches.push_back(&br);
+    return br;
   }
 
   //Processes the event, possible to override by child classes
@@ -384,10 +3481,41 @@ class TreeAnalyzer : public Analyzer {
     br_luminosityBlock = event.luminosityBlock;
     br_event = event.event;
 
-    out_tree->Fill();
+    fill();
+  }
+
+  // Fills the current values of the branches to the TTree, either directly
+  // or through the writer thread
+  void fill() {
+    if (writer != nullptr) {
+      writer->push();
+    } else if (output.async_ring_size > 0) {
+      start_writer();
+      writer->push();
+    } else {
+      out_tree->Fill();
+    }
   }
 
   virtual const string getName() const { return "TreeAnalyzer"; }
+
+  virtual Analyzer* clone(Output& output) const {
+    return new TreeAnalyzer(output);
+  }
+
+ protected:
+  vector<OutputBranch*> branches;
+  AsyncTreeWriter* writer;
+
+  // The writer is started at the first event, after the derived classes
+  // have declared their branches
+  void start_writer() {
+    if (out_tree->GetListOfBranches()->GetEntries() != static_cast<int>(branches.size())) {
+      throw std::runtime_error(getName() + ": the writer thread can only fill branches "
+                               "that are declared with TreeAnalyzer::branch()");
+    }
+    writer = &output.start_writer(string_hash("Events"), branches);
+  }
 };
 
 class FileReport {
@@ -410,20 +3538,63 @@ class FileReport {
   // Keeps track of the total duration (in nanoseconds) spent on each analyzer
   vector<unsigned long long> analyzer_durations;
 
+  // The total duration (in nanoseconds) of the analyzers that were run
+  // without timing each one, see Pipeline::timed
+  unsigned long long untimed_analyzer_duration;
+
+  // The time (in nanoseconds) the event loop waited for the input data to be
+  // read, and the time spent reading the input data in the background while
+  // the events were analyzed. Only measured by looper_batch, which sets
+  // io_timed, the other loops read the branches lazily in the analyzers and
+  // leave them out of the json report.
+  unsigned long long io_wait_duration;
+  unsigned long long io_hidden_duration;
+  bool io_timed;
+
   vector<string> analyzer_names;
 
+  // The number of events that passed each analyzer, i.e. for which
+  // Analyzer::process returned true
+  vector<unsigned long long> analyzer_num_passed;
+
     FileReport(const string& _filename,
                          const vector<Analyzer*>& analyzers)
+      : FileReport(_filename, get_analyzer_names(analyzers)) {}
+
+  FileReport(const string& _filename, const vector<string>& _analyzer_names)
       : event_duration(0),
         num_events_processed(0),
         cpu_time(0),
         real_time(0),
         speed(0),
-        filename(_filename) {
-    // Initialize the analyzer time counters
-    for (unsigned int iAnalyzer = 0; iAnalyzer < analyzers.size(); iAnalyzer++) {
-      analyzer_durations.push_back(0);
-      analyzer_names.push_back(analyzers.at(iAnalyzer)->getName());
+        filename(_filename),
+        analyzer_durations(_analyzer_names.size(), 0),
+        untimed_analyzer_duration(0),
+        io_wait_duration(0),
+        io_hidden_duration(0),
+        io_timed(false),
+        analyzer_names(_analyzer_names),
+        analyzer_num_passed(_analyzer_names.size(), 0) {}
+
+  static vector<string> get_analyzer_names(const vector<Analyzer*>& analyzers) {
+    vector<string> names;
+    for (const auto* analyzer : analyzers) {
+      names.push_back(analyzer->getName());
+    }
+    return names;
+  }
+
+  // Adds the counters of a report on another part of the same file
+  void merge(const FileReport& other) {
+    event_duration += other.event_duration;
+    num_events_processed += other.num_events_processed;
+    untimed_analyzer_duration += other.untimed_analyzer_duration;
+    io_wait_duration += other.io_wait_duration;
+    io_hidden_duration += other.io_hidden_duration;
+    io_timed = io_timed || other.io_timed;
+    for (unsigned int i = 0; i < analyzer_durations.size(); i++) {
+      analyzer_durations[i] += other.analyzer_durations.at(i);
+      analyzer_num_passed[i] += other.analyzer_num_passed.at(i);
     }
   }
 
@@ -432,7 +3603,7 @@ class FileReport {
     vector<double> analyzer_runtime_fracs;
     auto tot_duration =
         accumulate(analyzer_durations.begin(), analyzer_durations.end(), 0.0) +
-        event_duration;
+        untimed_analyzer_duration + event_duration;
 
     for (auto dur : analyzer_durations) {
       analyzer_runtime_fracs.push_back(dur / tot_duration);
@@ -447,6 +3618,9 @@ class FileReport {
     for (unsigned int i = 0; i < analyzer_names.size(); i++) {
       stream << analyzer_names[i] << "=" << analyzer_runtime_fracs[i] << ",";
     }
+    if (untimed_analyzer_duration > 0) {
+      stream << "untimed=" << untimed_analyzer_duration / tot_duration << ",";
+    }
     stream << endl;
   }
 
@@ -461,9 +3635,115 @@ static inline void to_json(json& j, const FileReport& p) {
            {"speed", p.speed},
            {"event_duration", p.event_duration},
            {"analyzer_durations", p.analyzer_durations},
-           {"analyzer_names", p.analyzer_names}};
+           {"untimed_analyzer_duration", p.untimed_analyzer_duration},
+           {"analyzer_names", p.analyzer_names},
+           {"analyzer_num_passed", p.analyzer_num_passed}};
+  if (p.io_timed) {
+    j["io_wait_duration"] = p.io_wait_duration;
+    j["io_hidden_duration"] = p.io_hidden_duration;
+  }
 }
 
+// A sequence of analyzers that is fixed at compile time, as an alternative
+// to vector<Analyzer*>. The analyzers are called through their concrete type,
+// such that the compiler can inline them into the event loop. The analyzers
+// are owned by the caller, e.g.
+//
+//   MuonEventAnalyzer muon_analyzer(output);
+//   MyTreeAnalyzer tree_analyzer(output);
+//   Pipeline<MyAnalysisEvent, MuonEventAnalyzer, MyTreeAnalyzer> pipeline(
+//       muon_analyzer, tree_analyzer);
+//   looper_main<MyAnalysisEvent, Configuration>(config, reader, output, pipeline);
+template <class EventClass, class... Analyzers>
+class Pipeline {
+ public:
+  static const size_t num_analyzers = sizeof...(Analyzers);
+
+  tuple<Analyzers&...> analyzers;
+
+  // If false, the analyzers run back to back without reading the clock in
+  // between and the FileReport only contains their total time, see
+  // FileReport::untimed_analyzer_duration
+  bool timed;
+
+  Pipeline(Analyzers&... _analyzers) : analyzers(_analyzers...), timed(true) {}
+
+  vector<string> names() const {
+    return names(make_index_sequence<num_analyzers>());
+  }
+
+  // Runs the analyzers on the event until one of them rejects it, adding the
+  // time spent in each to the report. Returns true if the event passed all
+  // the analyzers.
+  inline bool analyze(EventClass& event, FileReport& report) {
+    if (timed) {
+      return run_timed(event, report, make_index_sequence<num_analyzers>());
+    }
+    const auto time_t0 = chrono::high_resolution_clock::now();
+    const bool keep = run(event, report, make_index_sequence<num_analyzers>());
+    const auto time_t1 = chrono::high_resolution_clock::now();
+    report.untimed_analyzer_duration +=
+        chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count();
+    return keep;
+  }
+
+ private:
+  // The qualified calls avoid the virtual dispatch of Analyzer::process
+  template <class A>
+  static inline bool process_one(A& analyzer, EventClass& event, std::true_type) {
+    return analyzer.A::filter(event);
+  }
+
+  template <class A>
+  static inline bool process_one(A& analyzer, EventClass& event, std::false_type) {
+    analyzer.A::analyze(event);
+    return true;
+  }
+
+  template <size_t I>
+  inline bool run_one(EventClass& event, FileReport& report) {
+    auto& analyzer = get<I>(analyzers);
+    typedef typename std::remove_reference<decltype(analyzer)>::type A;
+    const bool keep = process_one(
+        analyzer, event, typename std::is_base_of<FilterAnalyzer, A>::type());
+    report.analyzer_num_passed[I] += keep;
+    return keep;
+  }
+
+  template <size_t... Is>
+  inline bool run(EventClass& event, FileReport& report, index_sequence<Is...>) {
+    // Calls run_one<I> for each analyzer in order, the && skips the
+    // remaining analyzers once the event is rejected
+    bool keep = true;
+    using expand = int[];
+    (void)expand{0, (keep = keep && run_one<Is>(event, report), 0)...};
+    return keep;
+  }
+
+  template <size_t I>
+  inline bool run_one_timed(EventClass& event, FileReport& report) {
+    const auto time_t0 = chrono::high_resolution_clock::now();
+    const bool keep = run_one<I>(event, report);
+    const auto time_t1 = chrono::high_resolution_clock::now();
+    report.analyzer_durations[I] +=
+        chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count();
+    return keep;
+  }
+
+  template <size_t... Is>
+  inline bool run_timed(EventClass& event, FileReport& report, index_sequence<Is...>) {
+    bool keep = true;
+    using expand = int[];
+    (void)expand{0, (keep = keep && run_one_timed<Is>(event, report), 0)...};
+    return keep;
+  }
+
+  template <size_t... Is>
+  vector<string> names(index_sequence<Is...>) const {
+    return vector<string>{get<Is>(analyzers).getName()...};
+  }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 //                            UTILITY FUNCTIONS                              //
@@ -476,11 +3756,47 @@ static inline string get_time() {
   auto now = chrono::system_clock::now();
   auto in_time_t = chrono::system_clock::to_time_t(now);
 
-  stringstream ss;
-  ss << put_time(localtime(&in_time_t), "%X");
-  return ss.str();
+  stringstream ss;
+  ss << put_time(localtime(&in_time_t), "%X");
+  return ss.str();
+}
+
+
+// Makes ROOT read ahead the input data in a background thread, such that the
+// next TTree cluster is already in memory when the event loop reaches it.
+// This must be called before the input files are opened.
+static inline void enable_async_prefetch() {
+  gEnv->SetValue("TFile.AsyncPrefetching", 1);
+}
+
+// Configures the TTreeCache of the input TTree, see Configuration. With
+// prefetching enabled, the baskets in the cache are decompressed in parallel
+// by the ROOT implicit multithreading pool, if it is enabled.
+template <class ConfigurationClass>
+static inline void setup_tree_cache(TTree* tree, const ConfigurationClass& config) {
+  if (config.cache_size > 0) {
+    tree->SetCacheSize(config.cache_size);
+  }
+  if (config.cache_learn_entries > 0) {
+    tree->SetCacheLearnEntries(config.cache_learn_entries);
+  }
+  if (config.prefetch) {
+    tree->SetParallelUnzip(true);
+  }
 }
 
+// Adds the branches to the TTreeCache right away instead of learning them
+// from the first entries, together with the branches holding the array lengths
+static inline void add_branches_to_cache(TTree* tree, const vector<string>& names) {
+  for (const auto& name : names) {
+    tree->AddBranchToCache(name.c_str(), true);
+    const auto* leaf = tree->GetLeaf(name.c_str());
+    if (leaf != nullptr && leaf->GetLeafCount() != nullptr) {
+      tree->AddBranchToCache(leaf->GetLeafCount()->GetName(), true);
+    }
+  }
+  tree->StopCacheLearningPhase();
+}
 
 // Helper function to create a TLorentzVector from spherical coordinates
 static inline TLorentzVector make_lv(float pt, float eta, float phi, float mass) {
@@ -496,35 +3812,127 @@ static inline TLorentzVector make_lv(float pt, float eta, float phi, float mass)
 ///////////////////////////////////////////////////////////////////////////////
 
 
+// Splits the entries [0, num_entries) of the TTree into num_ranges ranges of
+// about the same size, aligned to the TTree clusters
+static inline vector<pair<long long, long long>> make_cluster_ranges(
+    TTree* tree, long long num_entries, int num_ranges) {
+  vector<long long> boundaries = {0};
+  auto cluster_it = tree->GetClusterIterator(0);
+  while (boundaries.back() < num_entries) {
+    cluster_it.Next();
+    long long end = cluster_it.GetNextEntry();
+    if (end > num_entries || end <= boundaries.back()) {
+      end = num_entries;
+    }
+    boundaries.push_back(end);
+  }
+
+  vector<pair<long long, long long>> ranges;
+  long long begin = 0;
+  for (int irange = 1; irange <= num_ranges && begin < num_entries; irange++) {
+    // The first cluster boundary after the ideal end of this range
+    const long long target = num_entries * irange / num_ranges;
+    const auto end = *lower_bound(boundaries.begin(), boundaries.end(), target);
+    if (end > begin) {
+      ranges.push_back(make_pair(begin, end));
+      begin = end;
+    }
+  }
+  return ranges;
+}
+
+// The number of tasks for a file with num_entries entries
+static inline int get_num_tasks(long long num_entries, long long task_entries) {
+  task_entries = std::max(task_entries, 1ll);
+  return static_cast<int>((num_entries + task_entries - 1) / task_entries);
+}
+
+// Moves the histograms of an Output to its shards at the ends of the tasks
+// of looper_main_mt and looper_files_mt, such that looper_main adds up the
+// histograms in the same order as the multithreaded loops, see
+// Output::histogram_shards. task_ends are the end entries of the tasks.
+class TaskShards {
+ public:
+  Output& output;
+  vector<long long> task_ends;
+  unsigned long long first_shard;
+  size_t num_done;
+
+  TaskShards(Output& _output, const vector<long long>& _task_ends)
+      : output(_output),
+        task_ends(_task_ends),
+        first_shard(_output.reserve_shards(_task_ends.size())),
+        num_done(0) {}
+
+  // Called after the entry was processed
+  inline void entry_done(long long entry) {
+    if (num_done < task_ends.size() && entry + 1 >= task_ends[num_done]) {
+      output.add_shard(first_shard + num_done, output);
+      num_done += 1;
+    }
+  }
+
+  // Moves the histograms of a task that was cut short, e.g. by max_events
+  void finish() {
+    if (num_done < task_ends.size()) {
+      output.add_shard(first_shard + num_done, output);
+      num_done = task_ends.size();
+    }
+  }
+};
+
 // This is the main event loop
 // Given a TTreeReader reader, we process all the specified analyzers and store
 // the  output in the Output data structure.  You shouldn't have to add anything
 // to the event loop if you want to compute a new  quantity - rather, you can
 // add a new Analyzer
-template <class EventClass, class ConfigurationClass>
-FileReport looper_main(const ConfigurationClass& config,
-                       TTreeReader& reader, Output& output,
-                       const vector<Analyzer*>& analyzers) {
+//
+// The analyzers are called by process(event, report), which is either a loop
+// over vector<Analyzer*> or a Pipeline, see the looper_main overloads below.
+// It returns false if the event was rejected by one of the analyzers.
+// If end_entry >= 0, only the entries [first_entry, end_entry) are processed.
+// With shards, the histograms are moved to the shards at the end of each task.
+template <class EventClass, class ConfigurationClass, class ProcessFunction>
+FileReport looper_main_impl(const ConfigurationClass& config,
+                            TTreeReader& reader,
+                            const vector<string>& analyzer_names,
+                            ProcessFunction process,
+                            long long first_entry = 0,
+                            long long end_entry = -1,
+                            TaskShards* shards = nullptr) {
   // Make sure we clear the state of the reader
   reader.Restart();
 
+  long long num_entries = reader.GetEntries(true);
+  if (end_entry >= 0) {
+    reader.SetEntriesRange(first_entry, end_entry);
+    num_entries = end_entry - first_entry;
+  }
+
   TStopwatch sw;
   sw.Start();
 
   const auto filename = reader.GetTree()->GetCurrentFile()->GetPath();
 
+  setup_tree_cache(reader.GetTree(), config);
+
   // We initialize the C++ representation of the event (data row) from the
   // TTreeReader
   EventClass event(reader, config);
 
+  // Disable the branches that are not used, either right away or after a
+  // learning phase
+  const auto branch_learn_events =
+      event.start_branch_pruning(config.branch_learn_events);
+
   // Keep track of the number of events we processed
   unsigned long long nevents = 0;
 
   // Keep track of the total time per event
-  FileReport report(filename, analyzers);
+  FileReport report(filename, analyzer_names);
 
   // Start the loop over the TTree events
-  cout << "starting loop over " << reader.GetEntries(true)
+  cout << "starting loop over " << num_entries
        << " events in TTree " << reader.GetTree() << endl;
   while (reader.Next()) {
     // In case of early termination
@@ -535,6 +3943,9 @@ FileReport looper_main(const ConfigurationClass& config,
 
     auto time_t0 = chrono::high_resolution_clock::now();
 
+    // The branches of the new event are read on demand
+    event.next_generation();
+
     // We initialize the event
     event.analyze();
 
@@ -544,33 +3955,27 @@ FileReport looper_main(const ConfigurationClass& config,
             .count();
     report.event_duration += time_dt;
 
-    unsigned int iAnalyzer = 0;
-
-    // We run all the analyzers one after the other
-    for (auto* analyzer : analyzers) {
-      auto time_t0 = chrono::high_resolution_clock::now();
-
-      // Here we do the actual work for the analyzer
-      analyzer->analyze(event);
+    // We run all the analyzers one after the other, until one of them
+    // rejects the event
+    process(event, report);
 
-      // Get the time in nanoseconds spent per event for this analyzer
-      auto time_t1 = chrono::high_resolution_clock::now();
-      auto time_dt = chrono::duration_cast<chrono::nanoseconds>(
-                         time_t1 - time_t0)
-                         .count();
-      report.analyzer_durations[iAnalyzer] += time_dt;
+    if (shards != nullptr) {
+      shards->entry_done(first_entry + nevents);
+    }
 
-      iAnalyzer += 1;
+    // The learning phase is over, we know which branches are used
+    if (branch_learn_events > 0 && nevents + 1 == static_cast<unsigned long long>(branch_learn_events)) {
+      event.prune_branches();
     }
 
     // Print out a progress report
     if (nevents % config.report_period == 0) {
       const auto elapsed_time = sw.RealTime();
       const auto speed = nevents / elapsed_time;
-      const auto remaining_events = (reader.GetEntries(true) - nevents);
+      const auto remaining_events = (num_entries - nevents);
       const auto remaining_time = remaining_events / speed;
 
-      cout << "Processed " << nevents << "/" << reader.GetEntries(true)
+      cout << "Processed " << nevents << "/" << num_entries
            << " speed=" << speed / 1000.0 << "kHz ETA=" << remaining_time << "s"
            << endl;
       sw.Continue();
@@ -578,6 +3983,15 @@ FileReport looper_main(const ConfigurationClass& config,
     nevents += 1;
   }
   report.num_events_processed = nevents;
+  if (shards != nullptr) {
+    shards->finish();
+  }
+
+  // Only a completed learning phase has seen all the branches the analyzers
+  // use, e.g. not if the loop or its entry range ended before
+  if (branch_learn_events > 0 && nevents >= static_cast<unsigned long long>(branch_learn_events)) {
+    event.save_branch_usage();
+  }
 
   sw.Stop();
 
@@ -595,7 +4009,715 @@ FileReport looper_main(const ConfigurationClass& config,
        << ",speed=" << report.speed << endl;
 
   return report;
-} //looper_main
+} //looper_main_impl
+
+// Runs the analyzers on the event one after the other, each through a
+// virtual call, until one of them rejects the event
+static inline bool run_analyzers(const vector<Analyzer*>& analyzers,
+                                 NanoEvent& event, FileReport& report) {
+  unsigned int iAnalyzer = 0;
+  for (auto* analyzer : analyzers) {
+    auto time_t0 = chrono::high_resolution_clock::now();
+
+    // Here we do the actual work for the analyzer
+    const bool keep = analyzer->process(event);
+
+    // Get the time in nanoseconds spent per event for this analyzer
+    auto time_t1 = chrono::high_resolution_clock::now();
+    auto time_dt = chrono::duration_cast<chrono::nanoseconds>(
+                       time_t1 - time_t0)
+                       .count();
+    report.analyzer_durations[iAnalyzer] += time_dt;
+
+    // The event was rejected, skip the remaining analyzers
+    if (!keep) {
+      return false;
+    }
+    report.analyzer_num_passed[iAnalyzer] += 1;
+
+    iAnalyzer += 1;
+  }
+  return true;
+}
+
+// The shards of the tasks that looper_main_mt and looper_files_mt would
+// split the file of the reader into
+template <class ConfigurationClass>
+static inline TaskShards make_task_shards(const ConfigurationClass& config,
+                                          TTreeReader& reader, Output& output) {
+  long long num_entries = reader.GetEntries(true);
+  if (config.max_events > 0 && config.max_events < num_entries) {
+    num_entries = config.max_events;
+  }
+  vector<long long> task_ends;
+  for (const auto& range : make_cluster_ranges(reader.GetTree(), num_entries,
+                                               get_num_tasks(num_entries, config.task_entries))) {
+    task_ends.push_back(range.second);
+  }
+  return TaskShards(output, task_ends);
+}
+
+// Runs the analyzers given as a vector. The histograms are filled to the
+// same task shards as in looper_files_mt, such that they are bitwise
+// identical to the multithreaded result.
+template <class EventClass, class ConfigurationClass>
+FileReport looper_main(const ConfigurationClass& config,
+                       TTreeReader& reader, Output& output,
+                       const vector<Analyzer*>& analyzers) {
+  auto shards = make_task_shards(config, reader, output);
+  return looper_main_impl<EventClass>(
+      config, reader, FileReport::get_analyzer_names(analyzers),
+      [&analyzers](EventClass& event, FileReport& report) {
+        return run_analyzers(analyzers, event, report);
+      },
+      0, -1, &shards);
+}
+
+// Runs the analyzers of a Pipeline, which the compiler can inline
+template <class EventClass, class ConfigurationClass, class... Analyzers>
+FileReport looper_main(const ConfigurationClass& config,
+                       TTreeReader& reader, Output& output,
+                       Pipeline<EventClass, Analyzers...>& pipeline) {
+  auto shards = make_task_shards(config, reader, output);
+  return looper_main_impl<EventClass>(
+      config, reader, pipeline.names(),
+      [&pipeline](EventClass& event, FileReport& report) {
+        return pipeline.analyze(event, report);
+      },
+      0, -1, &shards);
+}
+
+// This is the multithreaded event loop
+// The file is split into cluster-aligned tasks of about config.task_entries
+// entries and each of the config.num_threads threads processes a contiguous
+// block of tasks. Each thread opens the file on its own and has its own
+// EventClass and clones of the analyzers (see Analyzer::clone), which write to
+// a thread-local Output. The histograms are moved to a shard of output after
+// each task, see Output::add_shard, and the TTrees are merged to output in
+// the order of the threads at the end, such that they keep the order of the
+// input events.
+template <class EventClass, class ConfigurationClass>
+FileReport looper_main_mt(const ConfigurationClass& config,
+                          const string& filename, Output& output,
+                          const vector<Analyzer*>& analyzers) {
+  TStopwatch sw;
+  sw.Start();
+
+  ROOT::EnableThreadSafety();
+
+  // Find the entry ranges of the tasks
+  vector<pair<long long, long long>> ranges;
+  {
+    unique_ptr<TFile> tf(TFile::Open(filename.c_str()));
+    if (tf == nullptr) {
+      throw std::runtime_error("looper_main_mt(): could not open file " + filename);
+    }
+    TTreeReader reader("Events", tf.get());
+    long long num_entries = reader.GetEntries(true);
+    if (config.max_events > 0 && config.max_events < num_entries) {
+      num_entries = config.max_events;
+    }
+    ranges = make_cluster_ranges(reader.GetTree(), num_entries,
+                                 get_num_tasks(num_entries, config.task_entries));
+  }
+  const unsigned int num_threads = std::min(
+      static_cast<unsigned int>(std::max(config.num_threads, 1)),
+      static_cast<unsigned int>(std::max(ranges.size(), size_t(1))));
+  const auto shard_base = output.reserve_shards(ranges.size());
+  cout << "looper_main_mt processing " << filename << " in " << ranges.size()
+       << " tasks with " << num_threads << " threads" << endl;
+
+  // Create the thread-local outputs and analyzers up front, such that ROOT
+  // objects are only created in this thread
+  const auto analyzer_names = FileReport::get_analyzer_names(analyzers);
+  vector<unique_ptr<Output>> thread_outputs;
+  vector<vector<unique_ptr<Analyzer>>> thread_analyzers(num_threads);
+  for (unsigned int ithread = 0; ithread < num_threads; ithread++) {
+    thread_outputs.push_back(output.make_thread_output(ithread));
+    for (const auto* analyzer : analyzers) {
+      thread_analyzers[ithread].push_back(
+          unique_ptr<Analyzer>(analyzer->clone(*thread_outputs[ithread])));
+    }
+  }
+  output.cd();
+
+  vector<FileReport> task_reports(ranges.size(), FileReport(filename, analyzer_names));
+  vector<exception_ptr> errors(num_threads);
+  vector<std::thread> threads;
+  for (unsigned int ithread = 0; ithread < num_threads; ithread++) {
+    threads.emplace_back([&, ithread]() {
+      try {
+        unique_ptr<TFile> tf(TFile::Open(filename.c_str()));
+        if (tf == nullptr) {
+          throw std::runtime_error("looper_main_mt(): could not open file " + filename);
+        }
+        TTreeReader reader("Events", tf.get());
+        vector<Analyzer*> local_analyzers;
+        for (auto& analyzer : thread_analyzers[ithread]) {
+          local_analyzers.push_back(analyzer.get());
+        }
+        const size_t first_task = ranges.size() * ithread / num_threads;
+        const size_t end_task = ranges.size() * (ithread + 1) / num_threads;
+        for (size_t itask = first_task; itask < end_task; itask++) {
+          task_reports[itask] = looper_main_impl<EventClass>(
+              config, reader, analyzer_names,
+              [&local_analyzers](EventClass& event, FileReport& report) {
+                return run_analyzers(local_analyzers, event, report);
+              },
+              ranges[itask].first, ranges[itask].second);
+          output.add_shard(shard_base + itask, *thread_outputs[ithread]);
+        }
+      } catch (...) {
+        errors[ithread] = current_exception();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& error : errors) {
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+
+  // Merge in a fixed order
+  FileReport report(filename, analyzer_names);
+  for (unsigned int ithread = 0; ithread < num_threads; ithread++) {
+    output.merge(*thread_outputs[ithread]);
+  }
+  for (const auto& task_report : task_reports) {
+    report.merge(task_report);
+  }
+
+  sw.Stop();
+  report.cpu_time = sw.CpuTime();
+  report.real_time = sw.RealTime();
+  report.speed =
+      (double)report.num_events_processed / report.real_time / 1000.0;
+
+  cout << "looper_main_mt"
+       << " nevents=" << report.num_events_processed
+       << ",cpu_time=" << report.cpu_time << ",real_time=" << report.real_time
+       << ",speed=" << report.speed << endl;
+
+  return report;
+} //looper_main_mt
+
+// Distributes tasks to worker threads. Each worker has its own queue of tasks
+// and takes from its front; a worker whose queue is empty steals from the back
+// of the queues of the others, such that all workers are kept busy until the
+// last task, even if the tasks have very different sizes. Each queue has its
+// own mutex, so the workers only contend when stealing.
+template <typename Task>
+class WorkStealingScheduler {
+ public:
+  WorkStealingScheduler(unsigned int num_workers) : queues(num_workers) {}
+
+  inline unsigned int num_workers() const { return queues.size(); }
+
+  // Adds a task to the queue of a worker, before run() is called
+  void push(unsigned int worker, const Task& task) {
+    auto& queue = queues.at(worker);
+    lock_guard<mutex> lock(queue.mtx);
+    queue.tasks.push_back(task);
+  }
+
+  // Gets the next task for the worker, returns false if there are no tasks
+  // left in any queue
+  bool pop(unsigned int worker, Task& task) {
+    {
+      auto& own = queues[worker];
+      lock_guard<mutex> lock(own.mtx);
+      if (!own.tasks.empty()) {
+        task = own.tasks.front();
+        own.tasks.pop_front();
+        return true;
+      }
+    }
+    for (unsigned int i = 1; i < queues.size(); i++) {
+      auto& victim = queues[(worker + i) % queues.size()];
+      lock_guard<mutex> lock(victim.mtx);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Runs process(worker, task) on all the tasks in num_workers() threads and
+  // rethrows the first exception, if any, after all the threads are done
+  template <class ProcessFunction>
+  void run(ProcessFunction process) {
+    vector<exception_ptr> errors(queues.size());
+    vector<std::thread> threads;
+    for (unsigned int worker = 0; worker < queues.size(); worker++) {
+      threads.emplace_back([this, worker, &process, &errors]() {
+        try {
+          Task task;
+          while (pop(worker, task)) {
+            process(worker, task);
+          }
+        } catch (...) {
+          errors[worker] = current_exception();
+          // Make the other workers stop as soon as possible
+          for (auto& queue : queues) {
+            lock_guard<mutex> lock(queue.mtx);
+            queue.tasks.clear();
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (auto& error : errors) {
+      if (error) {
+        rethrow_exception(error);
+      }
+    }
+  }
+
+ private:
+  class Queue {
+   public:
+    deque<Task> tasks;
+    mutex mtx;
+  };
+  deque<Queue> queues;
+};
+
+// A part of an input file processed by looper_files_mt
+class FileRangeTask {
+ public:
+  unsigned int ifile;
+  // the index of the task in the file
+  unsigned int itask;
+  // the index of the histogram shard of the task, see Output::add_shard
+  unsigned long long ishard;
+  long long first_entry;
+  long long end_entry;
+};
+
+// Processes all the input files in config.num_threads threads
+// Each file is split into cluster-aligned tasks of about config.task_entries
+// entries, and the tasks are distributed to the threads by a
+// WorkStealingScheduler. A small file does not leave threads idle while a
+// large one is still being processed. As in looper_main_mt, each thread has
+// its own analyzer clones and Output, the histograms are moved to a shard of
+// output after each task and the TTree entries of the tasks are merged to
+// output in the order of the tasks at the end, such that the output TTree
+// keeps the order of the input files and events.
+// Returns one FileReport per input file.
+template <class EventClass, class ConfigurationClass>
+vector<FileReport> looper_files_mt(const ConfigurationClass& config,
+                                   const vector<string>& filenames,
+                                   Output& output,
+                                   const vector<Analyzer*>& analyzers) {
+  TStopwatch sw;
+  sw.Start();
+
+  ROOT::EnableThreadSafety();
+  const unsigned int num_threads = std::max(config.num_threads, 1);
+
+  // Find the number of entries and the cluster boundaries of each file
+  vector<long long> file_entries;
+  vector<unique_ptr<TFile>> files;
+  for (const auto& filename : filenames) {
+    files.push_back(unique_ptr<TFile>(TFile::Open(filename.c_str())));
+    if (files.back() == nullptr) {
+      throw std::runtime_error("looper_files_mt(): could not open file " + filename);
+    }
+    TTreeReader reader("Events", files.back().get());
+    long long num_entries = reader.GetEntries(true);
+    if (config.max_events > 0 && config.max_events < num_entries) {
+      num_entries = config.max_events;
+    }
+    file_entries.push_back(num_entries);
+  }
+
+  WorkStealingScheduler<FileRangeTask> scheduler(num_threads);
+  vector<vector<FileReport>> task_reports(filenames.size());
+  const auto analyzer_names = FileReport::get_analyzer_names(analyzers);
+  vector<vector<pair<long long, long long>>> file_ranges;
+  unsigned int num_tasks = 0;
+  for (unsigned int ifile = 0; ifile < filenames.size(); ifile++) {
+    TTreeReader reader("Events", files[ifile].get());
+    file_ranges.push_back(make_cluster_ranges(
+        reader.GetTree(), file_entries[ifile],
+        get_num_tasks(file_entries[ifile], config.task_entries)));
+    num_tasks += file_ranges.back().size();
+  }
+  const auto shard_base = output.reserve_shards(num_tasks);
+
+  num_tasks = 0;
+  for (unsigned int ifile = 0; ifile < filenames.size(); ifile++) {
+    const auto& ranges = file_ranges[ifile];
+    for (unsigned int itask = 0; itask < ranges.size(); itask++) {
+      FileRangeTask task;
+      task.ifile = ifile;
+      task.itask = itask;
+      task.ishard = shard_base + num_tasks;
+      task.first_entry = ranges[itask].first;
+      task.end_entry = ranges[itask].second;
+      scheduler.push(num_tasks % num_threads, task);
+      task_reports[ifile].push_back(FileReport(filenames[ifile], analyzer_names));
+      num_tasks += 1;
+    }
+  }
+  files.clear();
+  cout << "looper_files_mt processing " << filenames.size() << " files in "
+       << num_tasks << " tasks with " << num_threads << " threads" << endl;
+
+  // The thread-local outputs and analyzers
+  vector<unique_ptr<Output>> thread_outputs;
+  vector<vector<Analyzer*>> thread_analyzers(num_threads);
+  vector<unique_ptr<Analyzer>> owned_analyzers;
+  for (unsigned int ithread = 0; ithread < num_threads; ithread++) {
+    thread_outputs.push_back(output.make_thread_output(ithread));
+    for (const auto* analyzer : analyzers) {
+      owned_analyzers.push_back(
+          unique_ptr<Analyzer>(analyzer->clone(*thread_outputs[ithread])));
+      thread_analyzers[ithread].push_back(owned_analyzers.back().get());
+    }
+  }
+  output.cd();
+
+  // The entries of the TTrees of each thread before its next task, and the
+  // entries that each task filled, such that the TTrees are merged in the
+  // order of the tasks
+  vector<unordered_map<HashKey, long long>> thread_entries(num_threads);
+  vector<unsigned int> task_thread(num_tasks);
+  vector<unordered_map<HashKey, long long>> task_first(num_tasks);
+  vector<unordered_map<HashKey, long long>> task_end(num_tasks);
+
+  // The file that each thread has open, such that consecutive tasks on the
+  // same file do not need to open it again
+  vector<int> open_file(num_threads, -1);
+  vector<unique_ptr<TFile>> thread_files(num_threads);
+  vector<unique_ptr<TTreeReader>> thread_readers(num_threads);
+
+  scheduler.run([&](unsigned int ithread, const FileRangeTask& task) {
+    if (open_file[ithread] != static_cast<int>(task.ifile)) {
+      thread_readers[ithread].reset();
+      thread_files[ithread].reset(TFile::Open(filenames[task.ifile].c_str()));
+      if (thread_files[ithread] == nullptr) {
+        throw std::runtime_error("looper_files_mt(): could not open file " + filenames[task.ifile]);
+      }
+      thread_readers[ithread] = make_unique<TTreeReader>("Events", thread_files[ithread].get());
+      open_file[ithread] = task.ifile;
+    }
+    const auto& local_analyzers = thread_analyzers[ithread];
+    task_reports[task.ifile][task.itask] = looper_main_impl<EventClass>(
+        config, *thread_readers[ithread], analyzer_names,
+        [&local_analyzers](EventClass& event, FileReport& report) {
+          return run_analyzers(local_analyzers, event, report);
+        },
+        task.first_entry, task.end_entry);
+    output.add_shard(task.ishard, *thread_outputs[ithread]);
+    const auto itask = task.ishard - shard_base;
+    task_thread[itask] = ithread;
+    task_first[itask] = thread_entries[ithread];
+    thread_entries[ithread] = thread_outputs[ithread]->tree_entries();
+    task_end[itask] = thread_entries[ithread];
+  });
+  thread_readers.clear();
+  thread_files.clear();
+
+  // The histograms are in the shards, only the TTree entries are merged
+  for (unsigned int itask = 0; itask < num_tasks; itask++) {
+    output.merge_entries(*thread_outputs[task_thread[itask]], task_first[itask], task_end[itask]);
+  }
+
+  sw.Stop();
+  const double cpu_eff = sw.CpuTime() / (sw.RealTime() * num_threads);
+
+  // Merge the reports of the tasks of each file. The real time of a file is
+  // the time the threads spent on it, its CPU time is estimated from the
+  // overall CPU efficiency of the threads.
+  vector<FileReport> reports;
+  unsigned long long num_events = 0;
+  for (unsigned int ifile = 0; ifile < filenames.size(); ifile++) {
+    FileReport report(filenames[ifile], analyzer_names);
+    for (const auto& task_report : task_reports[ifile]) {
+      report.merge(task_report);
+      report.real_time += task_report.real_time;
+    }
+    report.cpu_time = report.real_time * cpu_eff;
+    report.speed = (double)report.num_events_processed / report.real_time / 1000.0;
+    num_events += report.num_events_processed;
+    reports.push_back(report);
+  }
+  cout << "looper_files_mt"
+       << " nevents=" << num_events
+       << ",cpu_time=" << sw.CpuTime() << ",real_time=" << sw.RealTime()
+       << ",speed=" << num_events / sw.RealTime() / 1000.0 << endl;
+
+  return reports;
+} //looper_files_mt
+
+// Reads the batches of events in a background thread into two alternating
+// buffers, such that the next batch is read and decompressed while the
+// current one is analyzed. Only the background thread uses the TTreeReader.
+template <class BatchClass>
+class BatchPrefetcher {
+ public:
+  // The total time (in nanoseconds) spent reading batches in the background
+  unsigned long long read_duration;
+
+  template <class ConfigurationClass>
+  BatchPrefetcher(TTreeReader& reader, const ConfigurationClass& config,
+                  const vector<pair<long long, long long>>& _ranges)
+      : read_duration(0),
+        ranges(_ranges),
+        num_consumed(0),
+        stop(false) {
+    for (auto& buffer : buffers) {
+      buffer = make_unique<BatchClass>(reader, config);
+    }
+    filled.fill(false);
+    // The TTree must not be modified after the background thread started
+    add_branches_to_cache(reader.GetTree(), column_names());
+    worker = std::thread([this]() { this->run(); });
+  }
+
+  ~BatchPrefetcher() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  BatchPrefetcher(const BatchPrefetcher&) = delete;
+  BatchPrefetcher& operator=(const BatchPrefetcher&) = delete;
+
+  // The column names of the batches, e.g. for the TTreeCache
+  vector<string> column_names() const {
+    vector<string> names;
+    for (const auto& col : buffers[0]->columns) {
+      names.push_back(col->name);
+    }
+    return names;
+  }
+
+  // Releases the batch returned by the previous call and waits for the next
+  // one to be read. Returns nullptr after the last batch.
+  BatchClass* next() {
+    unique_lock<mutex> lock(mtx);
+    if (num_consumed > 0) {
+      filled[(num_consumed - 1) % 2] = false;
+      cv.notify_all();
+    }
+    if (num_consumed == ranges.size()) {
+      return nullptr;
+    }
+    const auto ibuf = num_consumed % 2;
+    cv.wait(lock, [this, ibuf]() { return filled[ibuf] || error; });
+    if (error) {
+      rethrow_exception(error);
+    }
+    num_consumed += 1;
+    return buffers[ibuf].get();
+  }
+
+ private:
+  array<unique_ptr<BatchClass>, 2> buffers;
+  array<bool, 2> filled;
+  const vector<pair<long long, long long>> ranges;
+  size_t num_consumed;
+  bool stop;
+  exception_ptr error;
+  mutex mtx;
+  condition_variable cv;
+  std::thread worker;
+
+  void run() {
+    try {
+      for (size_t ibatch = 0; ibatch < ranges.size(); ibatch++) {
+        const auto ibuf = ibatch % 2;
+        {
+          unique_lock<mutex> lock(mtx);
+          cv.wait(lock, [this, ibuf]() { return !filled[ibuf] || stop; });
+          if (stop) {
+            return;
+          }
+        }
+        const auto time_t0 = chrono::high_resolution_clock::now();
+        buffers[ibuf]->read(ranges[ibatch].first, ranges[ibatch].second);
+        const auto time_t1 = chrono::high_resolution_clock::now();
+        {
+          lock_guard<mutex> lock(mtx);
+          read_duration +=
+              chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count();
+          filled[ibuf] = true;
+        }
+        cv.notify_all();
+      }
+    } catch (...) {
+      {
+        lock_guard<mutex> lock(mtx);
+        error = current_exception();
+      }
+      cv.notify_all();
+    }
+  }
+};
+
+// This is the batched event loop
+// Instead of processing the events one by one, we read a batch of events
+// (a TTree cluster, or config.batch_size events) to the columns defined in
+// BatchClass and call Analyzer::analyze_batch on the batch. The columnar
+// layout allows analyzers to process many events in a tight loop.
+// With config.prefetch, the next batch is read in a background thread while
+// the current one is analyzed.
+template <class BatchClass, class ConfigurationClass>
+FileReport looper_batch(const ConfigurationClass& config,
+                        TTreeReader& reader, Output& output,
+                        const vector<Analyzer*>& analyzers) {
+  // Make sure we clear the state of the reader
+  reader.Restart();
+
+  TStopwatch sw;
+  sw.Start();
+
+  const auto filename = reader.GetTree()->GetCurrentFile()->GetPath();
+
+  setup_tree_cache(reader.GetTree(), config);
+
+  // Keep track of the total time per batch
+  FileReport report(filename, analyzers);
+  report.io_timed = true;
+
+  long long num_entries = reader.GetEntries(true);
+  if (config.max_events > 0 && config.max_events < num_entries) {
+    num_entries = config.max_events;
+  }
+
+  // Split the entries to batches
+  vector<pair<long long, long long>> ranges;
+  auto cluster_it = reader.GetTree()->GetClusterIterator(0);
+  for (long long begin = 0; begin < num_entries;) {
+    long long end = 0;
+    if (config.batch_size > 0) {
+      end = begin + config.batch_size;
+    } else {
+      cluster_it.Next();
+      end = cluster_it.GetNextEntry();
+    }
+    if (end > num_entries || end <= begin) {
+      end = num_entries;
+    }
+    ranges.push_back(make_pair(begin, end));
+    begin = end;
+  }
+
+  cout << "starting batched loop over " << num_entries << " events in "
+       << ranges.size() << " batches in TTree " << reader.GetTree() << endl;
+
+  long long num_processed = 0;
+  long long next_report = 0;
+
+  // Runs the analyzers on one batch, given the time it took to get the batch
+  auto process_batch = [&](BatchClass& batch, long long read_dt) {
+    auto time_t0 = chrono::high_resolution_clock::now();
+    batch.analyze();
+    auto time_t1 = chrono::high_resolution_clock::now();
+    report.event_duration += read_dt +
+        chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count();
+    report.io_wait_duration += read_dt;
+
+    unsigned int iAnalyzer = 0;
+    for (auto* analyzer : analyzers) {
+      auto time_t0 = chrono::high_resolution_clock::now();
+
+      analyzer->analyze_batch(batch);
+
+      auto time_t1 = chrono::high_resolution_clock::now();
+      report.analyzer_durations[iAnalyzer] +=
+          chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0)
+              .count();
+      iAnalyzer += 1;
+    }
+
+    num_processed += batch.num_events;
+
+    // Print out a progress report
+    if (num_processed >= next_report) {
+      const auto elapsed_time = sw.RealTime();
+      const auto speed = num_processed / elapsed_time;
+      const auto remaining_time = (num_entries - num_processed) / speed;
+
+      cout << "Processed " << num_processed << "/" << num_entries
+           << " speed=" << speed / 1000.0 << "kHz ETA=" << remaining_time
+           << "s" << endl;
+      sw.Continue();
+      next_report += config.report_period;
+    }
+  };
+
+  if (config.prefetch) {
+    // The analyzers may use ROOT (e.g. fill the output TTree) while the
+    // input is read in the background
+    ROOT::EnableThreadSafety();
+
+    BatchPrefetcher<BatchClass> prefetcher(reader, config, ranges);
+    while (true) {
+      auto time_t0 = chrono::high_resolution_clock::now();
+      auto* batch = prefetcher.next();
+      auto time_t1 = chrono::high_resolution_clock::now();
+      if (batch == nullptr) {
+        break;
+      }
+      process_batch(*batch, chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count());
+    }
+    if (prefetcher.read_duration > report.io_wait_duration) {
+      report.io_hidden_duration = prefetcher.read_duration - report.io_wait_duration;
+    }
+  } else {
+    // The columnar representation of the batch of events
+    BatchClass batch(reader, config);
+    vector<string> names;
+    for (const auto& col : batch.columns) {
+      names.push_back(col->name);
+    }
+    add_branches_to_cache(reader.GetTree(), names);
+
+    for (const auto& range : ranges) {
+      auto time_t0 = chrono::high_resolution_clock::now();
+
+      // Read the branches of all the events in the batch
+      batch.read(range.first, range.second);
+
+      auto time_t1 = chrono::high_resolution_clock::now();
+      process_batch(batch, chrono::duration_cast<chrono::nanoseconds>(time_t1 - time_t0).count());
+    }
+  }
+  report.num_events_processed = num_processed;
+
+  // The batched analyzers do not filter events
+  std::fill(report.analyzer_num_passed.begin(), report.analyzer_num_passed.end(),
+            report.num_events_processed);
+
+  sw.Stop();
+
+  report.cpu_time = sw.CpuTime();
+  report.real_time = sw.RealTime();
+  report.speed =
+      (double)report.num_events_processed / report.real_time / 1000.0;
+
+  cout << "looper_batch"
+       << " nevents=" << report.num_events_processed
+       << ",cpu_time=" << report.cpu_time << ",real_time=" << report.real_time
+       << ",speed=" << report.speed
+       << ",io_wait=" << report.io_wait_duration / 1e9
+       << "s,io_hidden=" << report.io_hidden_duration / 1e9 << "s" << endl;
+
+  return report;
+} //looper_batch
 
 } // namespace nanoflow
 #endif
@@ -0,0 +1,1743 @@
+#ifndef NANOFLOW_SIMD_H
+#define NANOFLOW_SIMD_H
+
+// Vectorized kernels over flattened jagged arrays (content + offsets, see
+// nanoflow::JaggedArray), used for object selection in batched analyzers.
+// Every kernel has a scalar implementation and, on x86-64, AVX2 and AVX-512
+// implementations which are selected at runtime based on the CPU. The
+// selection can be overridden by setting the environment variable
+// NANOFLOW_SIMD to "scalar", "avx2" or "avx512".
+//
+// The second part of this file has batched math functions for kinematics,
+// with an exact and a fast mode, see MathMode.
+//
+// The kernels do not depend on ROOT, such that they can be used from any
+// event loop.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NANOFLOW_SIMD_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#define NANOFLOW_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define NANOFLOW_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+#define NANOFLOW_SIMD_X86 0
+#endif
+
+namespace nanoflow {
+namespace simd {
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            RUNTIME DISPATCH                               //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// The instruction sets for which the kernels are implemented
+enum class ISA { Scalar = 0, AVX2 = 1, AVX512 = 2 };
+
+static inline const char* isa_name(ISA isa) {
+  switch (isa) {
+    case ISA::AVX512:
+      return "avx512";
+    case ISA::AVX2:
+      return "avx2";
+    default:
+      return "scalar";
+  }
+}
+
+// Finds the best instruction set supported by both the CPU and the OS
+static inline ISA detect_isa() {
+#if NANOFLOW_SIMD_X86
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return ISA::Scalar;
+  }
+  const bool osxsave = ecx & (1u << 27);
+  const bool avx = ecx & (1u << 28);
+  const bool fma = ecx & (1u << 12);
+  if (!(osxsave && avx && fma)) {
+    return ISA::Scalar;
+  }
+
+  // Check that the OS saves the AVX (and AVX-512) registers
+  unsigned int xcr0_lo = 0, xcr0_hi = 0;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6) {
+    return ISA::Scalar;
+  }
+
+  if (__get_cpuid_max(0, nullptr) < 7) {
+    return ISA::Scalar;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  const bool avx2 = ebx & (1u << 5);
+  const bool avx512f = ebx & (1u << 16);
+
+  if (avx512f && (xcr0_lo & 0xe6) == 0xe6) {
+    return ISA::AVX512;
+  }
+  if (avx2) {
+    return ISA::AVX2;
+  }
+#endif
+  return ISA::Scalar;
+}
+
+// The instruction set used by the kernels, detected once
+static inline ISA& active_isa() {
+  static ISA isa = []() {
+    ISA detected = detect_isa();
+    const char* env = std::getenv("NANOFLOW_SIMD");
+    if (env != nullptr) {
+      const std::string req(env);
+      ISA requested = detected;
+      if (req == "scalar") {
+        requested = ISA::Scalar;
+      } else if (req == "avx2") {
+        requested = ISA::AVX2;
+      } else if (req == "avx512") {
+        requested = ISA::AVX512;
+      }
+      // Never use an instruction set that the CPU does not support
+      if (static_cast<int>(requested) <= static_cast<int>(detected)) {
+        detected = requested;
+      }
+    }
+    return detected;
+  }();
+  return isa;
+}
+
+// Overrides the instruction set, e.g. for testing. Requesting an instruction
+// set that the CPU does not support falls back to the best supported one.
+static inline void set_isa(ISA isa) {
+  const auto detected = detect_isa();
+  active_isa() = static_cast<int>(isa) <= static_cast<int>(detected) ? isa : detected;
+}
+
+// The comparison operators for masks
+enum class Cmp { Greater, GreaterEqual, Less, LessEqual };
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            SCALAR KERNELS                                 //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+namespace scalar {
+
+static inline void segmented_sum(const float* content, const unsigned int* offsets,
+                                 size_t num_events, float* out) {
+  for (size_t iev = 0; iev < num_events; iev++) {
+    float sum = 0.0f;
+    for (unsigned int i = offsets[iev]; i < offsets[iev + 1]; i++) {
+      sum += content[i];
+    }
+    out[iev] = sum;
+  }
+}
+
+static inline void segmented_max(const float* content, const unsigned int* offsets,
+                                 size_t num_events, float* out, float empty_value) {
+  for (size_t iev = 0; iev < num_events; iev++) {
+    float mx = empty_value;
+    if (offsets[iev + 1] > offsets[iev]) {
+      // A NaN never compares greater, so it is skipped
+      mx = -std::numeric_limits<float>::infinity();
+      for (unsigned int i = offsets[iev]; i < offsets[iev + 1]; i++) {
+        mx = content[i] > mx ? content[i] : mx;
+      }
+    }
+    out[iev] = mx;
+  }
+}
+
+// The index of the first maximum element, skipping NaNs, -1 if there is none
+static inline int argmax_one(const float* x, unsigned int n) {
+  int best = -1;
+  for (unsigned int i = 0; i < n; i++) {
+    if (!std::isnan(x[i]) && (best < 0 || x[i] > x[best])) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static inline void segmented_argmax(const float* content, const unsigned int* offsets,
+                                    size_t num_events, int* out) {
+  for (size_t iev = 0; iev < num_events; iev++) {
+    out[iev] = argmax_one(content + offsets[iev], offsets[iev + 1] - offsets[iev]);
+  }
+}
+
+static inline bool compare_one(float x, Cmp op, float threshold) {
+  switch (op) {
+    case Cmp::Greater:
+      return x > threshold;
+    case Cmp::GreaterEqual:
+      return x >= threshold;
+    case Cmp::Less:
+      return x < threshold;
+    default:
+      return x <= threshold;
+  }
+}
+
+static inline void compare(const float* x, size_t n, Cmp op, float threshold,
+                           bool use_abs, uint8_t* mask) {
+  for (size_t i = 0; i < n; i++) {
+    const float v = use_abs ? std::abs(x[i]) : x[i];
+    mask[i] = compare_one(v, op, threshold);
+  }
+}
+
+static inline size_t compact(const float* x, const uint8_t* mask, size_t n,
+                             float* out) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (mask[i]) {
+      out[k++] = x[i];
+    }
+  }
+  return k;
+}
+
+// The bin of x on a uniform axis in the numbering of ROOT: 0 is the
+// underflow, nbins + 1 the overflow (also for NaN). The bin is computed as in
+// TAxis::FindBin, such that the values on the bin edges end up in the same
+// bins as with TH1::Fill.
+static inline int uniform_bin(double x, int nbins, double low, double high) {
+  if (x < low) {
+    return 0;
+  } else if (!(x < high)) {
+    return nbins + 1;
+  }
+  return 1 + static_cast<int>(nbins * (x - low) / (high - low));
+}
+
+static inline void uniform_bins(const float* x, size_t n, int nbins, double low,
+                                double high, int* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = uniform_bin(x[i], nbins, low, high);
+  }
+}
+
+
+// The difference of two angles wrapped to [-pi, pi], as nanoflow::delta_phi
+static inline float wrap_phi(float dphi) {
+  const float pi = static_cast<float>(M_PI);
+  if (dphi > pi || dphi < -pi) {
+    dphi = std::remainder(dphi, 2.0f * pi);
+  }
+  return dphi;
+}
+
+static inline void delta_r2(float eta0, float phi0, const float* eta, const float* phi,
+                            size_t n, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    const float deta = eta[i] - eta0;
+    const float dphi = wrap_phi(phi[i] - phi0);
+    out[i] = deta * deta + dphi * dphi;
+  }
+}
+
+}  // namespace scalar
+
+#if NANOFLOW_SIMD_X86
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                             AVX2 KERNELS                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+namespace avx2 {
+
+// Lanes [0, n) set, n <= 8
+NANOFLOW_TARGET_AVX2 static inline __m256i lane_mask(unsigned int n) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(n),
+                            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+NANOFLOW_TARGET_AVX2 static inline float hsum(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+NANOFLOW_TARGET_AVX2 static inline float hmax(__m256 v) {
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_max_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+// Loads n <= 8 elements, the other lanes are set to fill
+NANOFLOW_TARGET_AVX2 static inline __m256 load_partial(const float* x, unsigned int n,
+                                                       __m256 fill) {
+  if (n >= 8) {
+    return _mm256_loadu_ps(x);
+  }
+  const __m256i m = lane_mask(n);
+  return _mm256_blendv_ps(fill, _mm256_maskload_ps(x, m), _mm256_castsi256_ps(m));
+}
+
+// Converts the low 8 bits of a mask to 8 bytes of 0 or 1
+static inline const uint64_t* mask_bytes_table() {
+  static uint64_t table[256];
+  static bool init = []() {
+    for (unsigned int m = 0; m < 256; m++) {
+      uint64_t v = 0;
+      for (unsigned int b = 0; b < 8; b++) {
+        if (m & (1u << b)) {
+          v |= uint64_t(1) << (8 * b);
+        }
+      }
+      table[m] = v;
+    }
+    return true;
+  }();
+  (void)init;
+  return table;
+}
+
+// For each 8-bit mask, the permutation that moves the selected lanes to the
+// front, packed as 8 x 4 bit lane indices
+static inline const uint32_t* compact_perm_table() {
+  static uint32_t table[256];
+  static bool init = []() {
+    for (unsigned int m = 0; m < 256; m++) {
+      uint32_t v = 0;
+      unsigned int k = 0;
+      for (unsigned int b = 0; b < 8; b++) {
+        if (m & (1u << b)) {
+          v |= b << (4 * k);
+          k++;
+        }
+      }
+      table[m] = v;
+    }
+    return true;
+  }();
+  (void)init;
+  return table;
+}
+
+NANOFLOW_TARGET_AVX2 static inline void segmented_sum(const float* content,
+                                                      const unsigned int* offsets,
+                                                      size_t num_events, float* out) {
+  const __m256 zero = _mm256_setzero_ps();
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int end = offsets[iev + 1];
+    __m256 acc = zero;
+    for (unsigned int i = offsets[iev]; i < end; i += 8) {
+      acc = _mm256_add_ps(acc, load_partial(content + i, end - i, zero));
+    }
+    out[iev] = hsum(acc);
+  }
+}
+
+NANOFLOW_TARGET_AVX2 static inline void segmented_max(const float* content,
+                                                      const unsigned int* offsets,
+                                                      size_t num_events, float* out,
+                                                      float empty_value) {
+  const __m256 ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int begin = offsets[iev];
+    const unsigned int end = offsets[iev + 1];
+    if (begin == end) {
+      out[iev] = empty_value;
+      continue;
+    }
+    __m256 acc = ninf;
+    for (unsigned int i = begin; i < end; i += 8) {
+      acc = _mm256_max_ps(load_partial(content + i, end - i, ninf), acc);
+    }
+    out[iev] = hmax(acc);
+  }
+}
+
+NANOFLOW_TARGET_AVX2 static inline void segmented_argmax(const float* content,
+                                                         const unsigned int* offsets,
+                                                         size_t num_events, int* out) {
+  const __m256 ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int begin = offsets[iev];
+    const unsigned int end = offsets[iev + 1];
+    if (begin == end) {
+      out[iev] = -1;
+      continue;
+    }
+    __m256 acc = ninf;
+    for (unsigned int i = begin; i < end; i += 8) {
+      acc = _mm256_max_ps(load_partial(content + i, end - i, ninf), acc);
+    }
+    const __m256 mx = _mm256_set1_ps(hmax(acc));
+
+    // Find the first element equal to the maximum
+    int found = -1;
+    for (unsigned int i = begin; i < end && found < 0; i += 8) {
+      const __m256 v = load_partial(content + i, end - i, ninf);
+      const unsigned int lanes = end - i >= 8 ? 0xff : (1u << (end - i)) - 1;
+      const unsigned int eq =
+          _mm256_movemask_ps(_mm256_cmp_ps(v, mx, _CMP_EQ_OQ)) & lanes;
+      if (eq) {
+        found = i - begin + __builtin_ctz(eq);
+      }
+    }
+    // Only happens if all the values are NaN
+    if (found < 0) {
+      found = scalar::argmax_one(content + begin, end - begin);
+    }
+    out[iev] = found;
+  }
+}
+
+template <int Predicate>
+NANOFLOW_TARGET_AVX2 static inline void compare_impl(const float* x, size_t n,
+                                                     float threshold, bool use_abs,
+                                                     uint8_t* mask) {
+  const uint64_t* bytes = mask_bytes_table();
+  const __m256 thr = _mm256_set1_ps(threshold);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    if (use_abs) {
+      v = _mm256_and_ps(v, abs_mask);
+    }
+    const unsigned int m = _mm256_movemask_ps(_mm256_cmp_ps(v, thr, Predicate));
+    std::memcpy(mask + i, &bytes[m], 8);
+  }
+  for (; i < n; i++) {
+    const float v = use_abs ? std::abs(x[i]) : x[i];
+    switch (Predicate) {
+      case _CMP_GT_OQ:
+        mask[i] = v > threshold;
+        break;
+      case _CMP_GE_OQ:
+        mask[i] = v >= threshold;
+        break;
+      case _CMP_LT_OQ:
+        mask[i] = v < threshold;
+        break;
+      default:
+        mask[i] = v <= threshold;
+    }
+  }
+}
+
+NANOFLOW_TARGET_AVX2 static inline void compare(const float* x, size_t n, Cmp op,
+                                                float threshold, bool use_abs,
+                                                uint8_t* mask) {
+  switch (op) {
+    case Cmp::Greater:
+      return compare_impl<_CMP_GT_OQ>(x, n, threshold, use_abs, mask);
+    case Cmp::GreaterEqual:
+      return compare_impl<_CMP_GE_OQ>(x, n, threshold, use_abs, mask);
+    case Cmp::Less:
+      return compare_impl<_CMP_LT_OQ>(x, n, threshold, use_abs, mask);
+    default:
+      return compare_impl<_CMP_LE_OQ>(x, n, threshold, use_abs, mask);
+  }
+}
+
+NANOFLOW_TARGET_AVX2 static inline size_t compact(const float* x, const uint8_t* mask,
+                                                  size_t n, float* out) {
+  const uint32_t* perms = compact_perm_table();
+  const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+  const __m256i nibble = _mm256_set1_epi32(0xf);
+  size_t k = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t mbytes;
+    std::memcpy(&mbytes, mask + i, 8);
+    // one bit per lane from the 0/1 bytes
+    const __m128i mb = _mm_cmpgt_epi8(_mm_cvtsi64_si128(mbytes), _mm_setzero_si128());
+    const unsigned int m = _mm_movemask_epi8(mb) & 0xff;
+    const __m256i perm = _mm256_and_si256(
+        _mm256_srlv_epi32(_mm256_set1_epi32(perms[m]), shifts), nibble);
+    // k <= i, so writing 8 elements at out + k stays within the n elements
+    _mm256_storeu_ps(out + k, _mm256_permutevar8x32_ps(_mm256_loadu_ps(x + i), perm));
+    k += __builtin_popcount(m);
+  }
+  return k + scalar::compact(x + i, mask + i, n - i, out + k);
+}
+
+// The bins of 4 values, see scalar::uniform_bin. The under- and overflow are
+// blended in before the conversion to integers, which avoids the undefined
+// conversion of out-of-range values.
+NANOFLOW_TARGET_AVX2 static inline __m128i uniform_bins4(__m256d x, __m256d nb,
+                                                         __m256d low, __m256d high,
+                                                         __m256d width) {
+  __m256d t = _mm256_div_pd(_mm256_mul_pd(nb, _mm256_sub_pd(x, low)), width);
+  t = _mm256_blendv_pd(t, _mm256_set1_pd(-1.0), _mm256_cmp_pd(x, low, _CMP_LT_OQ));
+  t = _mm256_blendv_pd(t, nb, _mm256_cmp_pd(x, high, _CMP_NLT_UQ));
+  return _mm_add_epi32(_mm256_cvttpd_epi32(t), _mm_set1_epi32(1));
+}
+
+NANOFLOW_TARGET_AVX2 static inline void uniform_bins(const float* x, size_t n, int nbins,
+                                                     double low, double high, int* out) {
+  const __m256d nb = _mm256_set1_pd(nbins);
+  const __m256d lo = _mm256_set1_pd(low);
+  const __m256d hi = _mm256_set1_pd(high);
+  const __m256d width = _mm256_set1_pd(high - low);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(x + i);
+    const __m128i b0 = uniform_bins4(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), nb, lo, hi, width);
+    const __m128i b1 = uniform_bins4(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), nb, lo, hi, width);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), b0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), b1);
+  }
+  scalar::uniform_bins(x + i, n - i, nbins, low, high, out + i);
+}
+
+
+// Wraps the differences of angles to [-pi, pi]. The multiple of 2 pi is
+// subtracted with a fused multiply-add, which is exact like std::remainder.
+NANOFLOW_TARGET_AVX2 static inline __m256 wrap_phi(__m256 d) {
+  const float pi = static_cast<float>(M_PI);
+  const __m256 outside = _mm256_or_ps(_mm256_cmp_ps(d, _mm256_set1_ps(pi), _CMP_GT_OQ),
+                                      _mm256_cmp_ps(d, _mm256_set1_ps(-pi), _CMP_LT_OQ));
+  const __m256 k = _mm256_round_ps(_mm256_mul_ps(d, _mm256_set1_ps(0.5f / pi)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  return _mm256_blendv_ps(d, _mm256_fnmadd_ps(k, _mm256_set1_ps(2.0f * pi), d), outside);
+}
+
+NANOFLOW_TARGET_AVX2 static inline void delta_r2(float eta0, float phi0, const float* eta,
+                                                 const float* phi, size_t n, float* out) {
+  const __m256 veta0 = _mm256_set1_ps(eta0);
+  const __m256 vphi0 = _mm256_set1_ps(phi0);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 deta = _mm256_sub_ps(_mm256_loadu_ps(eta + i), veta0);
+    const __m256 dphi = wrap_phi(_mm256_sub_ps(_mm256_loadu_ps(phi + i), vphi0));
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(deta, deta, _mm256_mul_ps(dphi, dphi)));
+  }
+  scalar::delta_r2(eta0, phi0, eta + i, phi + i, n - i, out + i);
+}
+
+}  // namespace avx2
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                            AVX-512 KERNELS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+namespace avx512 {
+
+NANOFLOW_TARGET_AVX512 static inline __mmask16 lane_mask(unsigned int n) {
+  return n >= 16 ? __mmask16(0xffff) : __mmask16((1u << n) - 1);
+}
+
+NANOFLOW_TARGET_AVX512 static inline float hsum(__m512 v) {
+  const __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, _mm512_castps_pd(v), 0));
+  const __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, _mm512_castps_pd(v), 1));
+  return avx2::hsum(_mm256_add_ps(lo, hi));
+}
+
+NANOFLOW_TARGET_AVX512 static inline float hmax(__m512 v) {
+  const __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, _mm512_castps_pd(v), 0));
+  const __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, _mm512_castps_pd(v), 1));
+  return avx2::hmax(_mm256_max_ps(lo, hi));
+}
+
+NANOFLOW_TARGET_AVX512 static inline void segmented_sum(const float* content,
+                                                        const unsigned int* offsets,
+                                                        size_t num_events, float* out) {
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int end = offsets[iev + 1];
+    __m512 acc = _mm512_setzero_ps();
+    for (unsigned int i = offsets[iev]; i < end; i += 16) {
+      acc = _mm512_add_ps(acc, _mm512_maskz_loadu_ps(lane_mask(end - i), content + i));
+    }
+    out[iev] = hsum(acc);
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void segmented_max(const float* content,
+                                                        const unsigned int* offsets,
+                                                        size_t num_events, float* out,
+                                                        float empty_value) {
+  const __m512 ninf = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int begin = offsets[iev];
+    const unsigned int end = offsets[iev + 1];
+    if (begin == end) {
+      out[iev] = empty_value;
+      continue;
+    }
+    __m512 acc = ninf;
+    for (unsigned int i = begin; i < end; i += 16) {
+      const __m512 v = _mm512_mask_loadu_ps(ninf, lane_mask(end - i), content + i);
+      acc = _mm512_maskz_max_ps(0xffff, v, acc);
+    }
+    out[iev] = hmax(acc);
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void segmented_argmax(const float* content,
+                                                           const unsigned int* offsets,
+                                                           size_t num_events, int* out) {
+  const __m512 ninf = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int begin = offsets[iev];
+    const unsigned int end = offsets[iev + 1];
+    if (begin == end) {
+      out[iev] = -1;
+      continue;
+    }
+    __m512 acc = ninf;
+    for (unsigned int i = begin; i < end; i += 16) {
+      const __m512 v = _mm512_mask_loadu_ps(ninf, lane_mask(end - i), content + i);
+      acc = _mm512_maskz_max_ps(0xffff, v, acc);
+    }
+    const __m512 mx = _mm512_set1_ps(hmax(acc));
+
+    // Find the first element equal to the maximum
+    int found = -1;
+    for (unsigned int i = begin; i < end && found < 0; i += 16) {
+      const __mmask16 lanes = lane_mask(end - i);
+      const __m512 v = _mm512_mask_loadu_ps(ninf, lanes, content + i);
+      const unsigned int eq = _mm512_mask_cmp_ps_mask(lanes, v, mx, _CMP_EQ_OQ);
+      if (eq) {
+        found = i - begin + __builtin_ctz(eq);
+      }
+    }
+    // Only happens if all the values are NaN
+    if (found < 0) {
+      found = scalar::argmax_one(content + begin, end - begin);
+    }
+    out[iev] = found;
+  }
+}
+
+template <int Predicate>
+NANOFLOW_TARGET_AVX512 static inline void compare_impl(const float* x, size_t n,
+                                                       float threshold, bool use_abs,
+                                                       uint8_t* mask) {
+  const __m512 thr = _mm512_set1_ps(threshold);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i abs_mask = _mm512_set1_epi32(0x7fffffff);
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    __m512 v = _mm512_maskz_loadu_ps(lanes, x + i);
+    if (use_abs) {
+      v = _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(v), abs_mask));
+    }
+    const __mmask16 m = _mm512_mask_cmp_ps_mask(lanes, v, thr, Predicate);
+    const __m128i b = _mm512_maskz_cvtepi32_epi8(0xffff, _mm512_maskz_mov_epi32(m, one));
+    if (lanes == 0xffff) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), b);
+    } else {
+      uint8_t tmp[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(tmp), b);
+      std::memcpy(mask + i, tmp, n - i);
+    }
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void compare(const float* x, size_t n, Cmp op,
+                                                  float threshold, bool use_abs,
+                                                  uint8_t* mask) {
+  switch (op) {
+    case Cmp::Greater:
+      return compare_impl<_CMP_GT_OQ>(x, n, threshold, use_abs, mask);
+    case Cmp::GreaterEqual:
+      return compare_impl<_CMP_GE_OQ>(x, n, threshold, use_abs, mask);
+    case Cmp::Less:
+      return compare_impl<_CMP_LT_OQ>(x, n, threshold, use_abs, mask);
+    default:
+      return compare_impl<_CMP_LE_OQ>(x, n, threshold, use_abs, mask);
+  }
+}
+
+// Loads up to 16 mask bytes without reading past the end
+NANOFLOW_TARGET_AVX512 static inline __m128i load_mask_bytes(const uint8_t* mask,
+                                                             size_t n) {
+  if (n >= 16) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+  }
+  uint8_t tmp[16] = {0};
+  std::memcpy(tmp, mask, n);
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmp));
+}
+
+NANOFLOW_TARGET_AVX512 static inline size_t compact(const float* x, const uint8_t* mask,
+                                                    size_t n, float* out) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512i mb = _mm512_maskz_cvtepu8_epi32(0xffff, load_mask_bytes(mask + i, n - i));
+    const __mmask16 m = _mm512_mask_test_epi32_mask(lanes, mb, mb);
+    _mm512_mask_compressstoreu_ps(out + k, m, _mm512_maskz_loadu_ps(lanes, x + i));
+    k += __builtin_popcount(m);
+  }
+  return k;
+}
+
+NANOFLOW_TARGET_AVX512 static inline void uniform_bins(const float* x, size_t n, int nbins,
+                                                       double low, double high, int* out) {
+  const __m512d nb = _mm512_set1_pd(nbins);
+  const __m512d lo = _mm512_set1_pd(low);
+  const __m512d hi = _mm512_set1_pd(high);
+  const __m512d width = _mm512_set1_pd(high - low);
+  const __m512d minus_one = _mm512_set1_pd(-1.0);
+  const __m256i one = _mm256_set1_epi32(1);
+  for (size_t i = 0; i < n; i += 8) {
+    const __mmask16 lanes = lane_mask(n - i < 8 ? n - i : 8);
+    const __m512 v16 = _mm512_maskz_loadu_ps(lanes, x + i);
+    const __m512d v = _mm512_maskz_cvtps_pd(
+        0xff, _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, _mm512_castps_pd(v16), 0)));
+    __m512d t = _mm512_div_pd(_mm512_mul_pd(nb, _mm512_sub_pd(v, lo)), width);
+    t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, lo, _CMP_LT_OQ), t, minus_one);
+    t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, hi, _CMP_NLT_UQ), t, nb);
+    const __m256i b = _mm256_add_epi32(_mm512_maskz_cvttpd_epi32(0xff, t), one);
+    if (n - i >= 8) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), b);
+    } else {
+      int tmp[8];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(tmp), b);
+      std::memcpy(out + i, tmp, (n - i) * sizeof(int));
+    }
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline __m512 wrap_phi(__m512 d) {
+  const float pi = static_cast<float>(M_PI);
+  const __mmask16 outside = _mm512_cmp_ps_mask(d, _mm512_set1_ps(pi), _CMP_GT_OQ) |
+                            _mm512_cmp_ps_mask(d, _mm512_set1_ps(-pi), _CMP_LT_OQ);
+  const __m512 k = _mm512_maskz_roundscale_ps(
+      0xffff, _mm512_mul_ps(d, _mm512_set1_ps(0.5f / pi)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  return _mm512_mask_blend_ps(outside, d, _mm512_fnmadd_ps(k, _mm512_set1_ps(2.0f * pi), d));
+}
+
+NANOFLOW_TARGET_AVX512 static inline void delta_r2(float eta0, float phi0, const float* eta,
+                                                   const float* phi, size_t n, float* out) {
+  const __m512 veta0 = _mm512_set1_ps(eta0);
+  const __m512 vphi0 = _mm512_set1_ps(phi0);
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 deta = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, eta + i), veta0);
+    const __m512 dphi = wrap_phi(_mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, phi + i), vphi0));
+    _mm512_mask_storeu_ps(out + i, lanes, _mm512_fmadd_ps(deta, deta, _mm512_mul_ps(dphi, dphi)));
+  }
+}
+
+}  // namespace avx512
+
+#endif  // NANOFLOW_SIMD_X86
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                               PUBLIC API                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// In all the kernels, the jagged array is given by its content and the
+// offsets (num_events + 1 entries), such that the elements of event iev are
+// content[offsets[iev]] ... content[offsets[iev + 1] - 1].
+// Note that the vectorized sums add the elements in a different order than
+// the scalar loop, so the results can differ in the last bits.
+
+// The sum of the elements of each event, 0 for empty events
+static inline void segmented_sum(const float* content, const unsigned int* offsets,
+                                 size_t num_events, float* out) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::segmented_sum(content, offsets, num_events, out);
+    case ISA::AVX2:
+      return avx2::segmented_sum(content, offsets, num_events, out);
+#endif
+    default:
+      return scalar::segmented_sum(content, offsets, num_events, out);
+  }
+}
+
+// The maximum element of each event, empty_value for empty events. NaN
+// elements are skipped by all the ISAs, such that an event with only NaNs
+// gives -inf. max(a, b) of SSE and AVX returns b if either is NaN, so the
+// vector kernels keep the accumulator as the second operand.
+static inline void segmented_max(
+    const float* content, const unsigned int* offsets, size_t num_events,
+    float* out, float empty_value = -std::numeric_limits<float>::infinity()) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::segmented_max(content, offsets, num_events, out, empty_value);
+    case ISA::AVX2:
+      return avx2::segmented_max(content, offsets, num_events, out, empty_value);
+#endif
+    default:
+      return scalar::segmented_max(content, offsets, num_events, out, empty_value);
+  }
+}
+
+// The index within the event of the first maximum element, -1 for empty
+// events. NaN elements are skipped like in segmented_max, -1 for events with
+// only NaNs.
+static inline void segmented_argmax(const float* content, const unsigned int* offsets,
+                                    size_t num_events, int* out) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::segmented_argmax(content, offsets, num_events, out);
+    case ISA::AVX2:
+      return avx2::segmented_argmax(content, offsets, num_events, out);
+#endif
+    default:
+      return scalar::segmented_argmax(content, offsets, num_events, out);
+  }
+}
+
+// Sets mask[i] = 1 if x[i] (or |x[i]| if use_abs) compares as op to
+// threshold, 0 otherwise. E.g. pt > 20 is compare(pt, n, Cmp::Greater, 20)
+static inline void compare(const float* x, size_t n, Cmp op, float threshold,
+                           uint8_t* mask, bool use_abs = false) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::compare(x, n, op, threshold, use_abs, mask);
+    case ISA::AVX2:
+      return avx2::compare(x, n, op, threshold, use_abs, mask);
+#endif
+    default:
+      return scalar::compare(x, n, op, threshold, use_abs, mask);
+  }
+}
+
+// Compares |x[i]| to threshold, e.g. |eta| < 2.4
+static inline void compare_abs(const float* x, size_t n, Cmp op, float threshold,
+                               uint8_t* mask) {
+  compare(x, n, op, threshold, mask, true);
+}
+
+// Element-wise logical operations on masks, these loops are simple enough
+// to be vectorized by the compiler
+static inline void mask_and(const uint8_t* a, const uint8_t* b, size_t n, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] & b[i];
+  }
+}
+
+static inline void mask_or(const uint8_t* a, const uint8_t* b, size_t n, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] | b[i];
+  }
+}
+
+static inline void mask_not(const uint8_t* a, size_t n, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] ^ 1;
+  }
+}
+
+// The number of selected elements in each event
+static inline void segmented_count(const uint8_t* mask, const unsigned int* offsets,
+                                   size_t num_events, unsigned int* out) {
+  for (size_t iev = 0; iev < num_events; iev++) {
+    unsigned int count = 0;
+    for (unsigned int i = offsets[iev]; i < offsets[iev + 1]; i++) {
+      count += mask[i];
+    }
+    out[iev] = count;
+  }
+}
+
+// Copies the selected elements of x to out, which needs to have room for n
+// elements. Returns the number of selected elements.
+static inline size_t compact(const float* x, const uint8_t* mask, size_t n, float* out) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::compact(x, mask, n, out);
+    case ISA::AVX2:
+      return avx2::compact(x, mask, n, out);
+#endif
+    default:
+      return scalar::compact(x, mask, n, out);
+  }
+}
+
+// Writes the indices of the selected elements to out, which needs to have
+// room for n elements. Returns the number of selected elements.
+// The indices can be used to gather the other columns of the same objects.
+static inline size_t compact_indices(const uint8_t* mask, size_t n, unsigned int* out) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    out[k] = i;
+    k += mask[i];
+  }
+  return k;
+}
+
+// Compacts a jagged array: the selected elements are copied to out_content
+// (room for offsets[num_events] elements) and the offsets of the result are
+// written to out_offsets (num_events + 1 entries). Returns the number of
+// selected elements.
+static inline size_t compact_jagged(const float* content, const unsigned int* offsets,
+                                    size_t num_events, const uint8_t* mask,
+                                    float* out_content, unsigned int* out_offsets) {
+  out_offsets[0] = 0;
+  segmented_count(mask, offsets, num_events, out_offsets + 1);
+  for (size_t iev = 0; iev < num_events; iev++) {
+    out_offsets[iev + 1] += out_offsets[iev];
+  }
+  return compact(content, mask, offsets[num_events], out_content);
+}
+
+// The histogram bins of the values on a uniform axis with nbins bins in
+// [low, high), including the underflow (0) and overflow (nbins + 1) bins.
+// All implementations give the same bins as TAxis::FindBin.
+static inline void uniform_bins(const float* x, size_t n, int nbins, double low,
+                                double high, int* out) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::uniform_bins(x, n, nbins, low, high, out);
+    case ISA::AVX2:
+      return avx2::uniform_bins(x, n, nbins, low, high, out);
+#endif
+    default:
+      return scalar::uniform_bins(x, n, nbins, low, high, out);
+  }
+}
+
+// The squared distances in (eta, phi) of the object (eta0, phi0) to the n
+// objects, e.g. one row of the deltaR matrix of two collections. The
+// differences in phi are wrapped to [-pi, pi] as in nanoflow::delta_r2. The
+// vectorized implementations use fused multiply-adds, so the results can
+// differ from nanoflow::delta_r2 in the last bit.
+static inline void delta_r2(float eta0, float phi0, const float* eta, const float* phi,
+                            size_t n, float* out) {
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::delta_r2(eta0, phi0, eta, phi, n, out);
+    case ISA::AVX2:
+      return avx2::delta_r2(eta0, phi0, eta, phi, n, out);
+#endif
+    default:
+      return scalar::delta_r2(eta0, phi0, eta, phi, n, out);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                             MATH FUNCTIONS                                //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// Batched single-precision math functions for kinematics, e.g. to convert the
+// pt, eta, phi of NanoAOD objects to px, py, pz. Every function can be called
+// in two modes:
+//  - MathMode::Exact calls the C++ standard library (libm) for each value
+//  - MathMode::Fast uses polynomial approximations (after Cephes), which are
+//    vectorized with AVX2 or AVX-512. Values outside of the range of the
+//    approximations, including inf and NaN, are passed to libm.
+// The maximum errors of the fast mode, measured against double precision with
+// bin/nf_mathbench, are
+//   sin, cos, sincos   |x| <= pi             1 ULP
+//                      |x| <= 8192           1e-7 absolute (up to ~700 ULP
+//                                            close to the zeros)
+//   sinh               all x                 2 ULP
+//   atan2              all x, y              3 ULP
+//   sqrt               all x                 0 ULP (correctly rounded)
+//   log                all x                 1 ULP
+// while libm is within 1 ULP (2 ULP for sinh).
+// The AVX2 and AVX-512 implementations use fused multiply-adds, so their
+// results can differ from the scalar implementation in the last bit.
+// The output array may be the same as the input array.
+
+enum class MathMode { Exact, Fast };
+
+namespace scalar {
+
+// Constants of the approximations
+namespace math {
+static const float FOPI = 1.27323954473516f;  // 4 / pi
+static const float DP1 = 0.78515625f;  // pi / 4 split in three parts
+static const float DP2 = 2.4187564849853515625e-4f;
+static const float DP3 = 3.77489497744594108e-8f;
+static const float SIN_P0 = -1.9515295891e-4f;
+static const float SIN_P1 = 8.3321608736e-3f;
+static const float SIN_P2 = -1.6666654611e-1f;
+static const float COS_P0 = 2.443315711809948e-5f;
+static const float COS_P1 = -1.388731625493765e-3f;
+static const float COS_P2 = 4.166664568298827e-2f;
+static const float SINCOS_MAX = 8192.0f;
+
+static const float LOG2E = 1.44269504088896341f;
+static const float EXP_C1 = 0.693359375f;  // ln 2 split in two parts
+static const float EXP_C2 = -2.12194440e-4f;
+static const float EXP_P0 = 1.9875691500e-4f;
+static const float EXP_P1 = 1.3981999507e-3f;
+static const float EXP_P2 = 8.3334519073e-3f;
+static const float EXP_P3 = 4.1665795894e-2f;
+static const float EXP_P4 = 1.6666665459e-1f;
+static const float EXP_P5 = 5.0000001201e-1f;
+static const float SINH_P0 = 2.03721912945e-4f;
+static const float SINH_P1 = 8.33028376239e-3f;
+static const float SINH_P2 = 1.66667160211e-1f;
+static const float SINH_MAX = 88.0f;
+
+static const float ATAN_P0 = 8.05374449538e-2f;
+static const float ATAN_P1 = -1.38776856032e-1f;
+static const float ATAN_P2 = 1.99777106478e-1f;
+static const float ATAN_P3 = -3.33329491539e-1f;
+static const float TAN_PI_8 = 0.4142135623730950f;
+static const float PI = 3.14159265358979f;
+static const float PI_2 = 1.57079632679490f;
+static const float PI_4 = 0.78539816339745f;
+
+static const float SQRTHF = 0.707106781186547524f;
+static const float LOG_P0 = 7.0376836292e-2f;
+static const float LOG_P1 = -1.1514610310e-1f;
+static const float LOG_P2 = 1.1676998740e-1f;
+static const float LOG_P3 = -1.2420140846e-1f;
+static const float LOG_P4 = 1.4249322787e-1f;
+static const float LOG_P5 = -1.6668057665e-1f;
+static const float LOG_P6 = 2.0000714765e-1f;
+static const float LOG_P7 = -2.4999993993e-1f;
+static const float LOG_P8 = 3.3333331174e-1f;
+}  // namespace math
+
+static inline void fast_sincos_one(float x, float& s, float& c) {
+  using namespace math;
+  if (!(std::abs(x) <= SINCOS_MAX)) {
+    s = std::sin(x);
+    c = std::cos(x);
+    return;
+  }
+  float a = std::abs(x);
+  // The octant, rounded up to even: a = j * pi / 4 + r, |r| <= pi / 4
+  int j = static_cast<int>(a * FOPI);
+  j = (j + 1) & ~1;
+  const float y = static_cast<float>(j);
+  const bool sin_poly = (j & 2) == 0;
+  const bool sin_negative = std::signbit(x) != ((j & 4) != 0);
+  const bool cos_negative = ((j - 2) & 4) == 0;
+  a = ((a - y * DP1) - y * DP2) - y * DP3;
+  const float z = a * a;
+  const float pc = ((COS_P0 * z + COS_P1) * z + COS_P2) * z * z - 0.5f * z + 1.0f;
+  const float ps = ((SIN_P0 * z + SIN_P1) * z + SIN_P2) * z * a + a;
+  s = sin_poly ? ps : pc;
+  c = sin_poly ? pc : ps;
+  s = sin_negative ? -s : s;
+  c = cos_negative ? -c : c;
+}
+
+// exp(x) for x in [-87, 88]
+static inline float fast_exp_one(float x) {
+  using namespace math;
+  const float fx = std::floor(x * LOG2E + 0.5f);
+  x = x - fx * EXP_C1;
+  x = x - fx * EXP_C2;
+  const float z = x * x;
+  float y = (((((EXP_P0 * x + EXP_P1) * x + EXP_P2) * x + EXP_P3) * x + EXP_P4) * x + EXP_P5);
+  y = y * z + x + 1.0f;
+  const uint32_t bits = static_cast<uint32_t>(static_cast<int>(fx) + 127) << 23;
+  float pow2n;
+  std::memcpy(&pow2n, &bits, sizeof(float));
+  return y * pow2n;
+}
+
+static inline float fast_sinh_one(float x) {
+  using namespace math;
+  const float a = std::abs(x);
+  if (!(a <= SINH_MAX)) {
+    return std::sinh(x);
+  }
+  float r;
+  if (a < 1.0f) {
+    const float z = a * a;
+    r = ((SINH_P0 * z + SINH_P1) * z + SINH_P2) * z * a + a;
+  } else {
+    const float z = fast_exp_one(a);
+    r = 0.5f * z - 0.5f / z;
+  }
+  return std::copysign(r, x);
+}
+
+static inline float fast_atan2_one(float y, float x) {
+  using namespace math;
+  const float ax = std::abs(x);
+  const float ay = std::abs(y);
+  const float den = ax > ay ? ax : ay;
+  const float num = ax > ay ? ay : ax;
+  if (!(den > 0.0f) || !(den <= std::numeric_limits<float>::max())) {
+    return std::atan2(y, x);
+  }
+  // atan(z) for z in [0, 1], reduced to |z| <= tan(pi / 8)
+  float z = num / den;
+  float offset = 0.0f;
+  if (z > TAN_PI_8) {
+    z = (z - 1.0f) / (z + 1.0f);
+    offset = PI_4;
+  }
+  const float zz = z * z;
+  float r = (((ATAN_P0 * zz + ATAN_P1) * zz + ATAN_P2) * zz + ATAN_P3) * zz * z + z + offset;
+  r = ay > ax ? PI_2 - r : r;
+  r = std::signbit(x) ? PI - r : r;
+  return std::copysign(r, y);
+}
+
+static inline float fast_log_one(float x) {
+  using namespace math;
+  if (!(x >= std::numeric_limits<float>::min()) ||
+      !(x <= std::numeric_limits<float>::max())) {
+    return std::log(x);
+  }
+  // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), computed on the bits without
+  // branches since the mantissas of real data are random
+  uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(float));
+  bits += 0x3f800000u - 0x3f3504f3u;
+  const float e = static_cast<float>(static_cast<int>(bits >> 23) - 0x7f);
+  bits = (bits & 0x007fffffu) + 0x3f3504f3u;
+  float m;
+  std::memcpy(&m, &bits, sizeof(float));
+  m -= 1.0f;
+  const float z = m * m;
+  float y = ((((((((LOG_P0 * m + LOG_P1) * m + LOG_P2) * m + LOG_P3) * m + LOG_P4) * m +
+                LOG_P5) * m + LOG_P6) * m + LOG_P7) * m + LOG_P8);
+  y = y * m * z;
+  y += e * EXP_C2;
+  y += -0.5f * z;
+  return m + y + e * EXP_C1;
+}
+
+static inline void sincos(const float* x, size_t n, float* s, float* c) {
+  for (size_t i = 0; i < n; i++) {
+    float si, ci;
+    fast_sincos_one(x[i], si, ci);
+    if (s != nullptr) {
+      s[i] = si;
+    }
+    if (c != nullptr) {
+      c[i] = ci;
+    }
+  }
+}
+
+static inline void sinh(const float* x, size_t n, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = fast_sinh_one(x[i]);
+  }
+}
+
+static inline void atan2(const float* y, const float* x, size_t n, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = fast_atan2_one(y[i], x[i]);
+  }
+}
+
+static inline void sqrt(const float* x, size_t n, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = std::sqrt(x[i]);
+  }
+}
+
+static inline void log(const float* x, size_t n, float* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = fast_log_one(x[i]);
+  }
+}
+
+}  // namespace scalar
+
+#if NANOFLOW_SIMD_X86
+
+namespace avx2 {
+
+// Replaces the lanes of out in the mask by f(x), used for the inputs outside
+// of the range of the approximations
+template <class F>
+static inline void fix_lanes(unsigned int mask, const float* x, float* out, F f) {
+  while (mask) {
+    const int k = __builtin_ctz(mask);
+    out[k] = f(x[k]);
+    mask &= mask - 1;
+  }
+}
+
+NANOFLOW_TARGET_AVX2 static inline __m256 abs_ps(__m256 x) {
+  return _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+NANOFLOW_TARGET_AVX2 static inline __m256 sign_ps(__m256 x) {
+  return _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000)));
+}
+
+NANOFLOW_TARGET_AVX2 static inline void sincos8(__m256 x, __m256& s, __m256& c) {
+  using namespace scalar::math;
+  __m256 a = abs_ps(x);
+  __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(a, _mm256_set1_ps(FOPI)));
+  j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+  const __m256 y = _mm256_cvtepi32_ps(j);
+  const __m256 sin_poly = _mm256_castsi256_ps(
+      _mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_setzero_si256()));
+  const __m256 sin_sign = _mm256_xor_ps(
+      sign_ps(x),
+      _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29)));
+  const __m256 cos_sign = _mm256_castsi256_ps(_mm256_slli_epi32(
+      _mm256_andnot_si256(_mm256_sub_epi32(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+  a = _mm256_fnmadd_ps(y, _mm256_set1_ps(DP1), a);
+  a = _mm256_fnmadd_ps(y, _mm256_set1_ps(DP2), a);
+  a = _mm256_fnmadd_ps(y, _mm256_set1_ps(DP3), a);
+  const __m256 z = _mm256_mul_ps(a, a);
+  __m256 pc = _mm256_fmadd_ps(_mm256_set1_ps(COS_P0), z, _mm256_set1_ps(COS_P1));
+  pc = _mm256_fmadd_ps(pc, z, _mm256_set1_ps(COS_P2));
+  pc = _mm256_mul_ps(_mm256_mul_ps(pc, z), z);
+  pc = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, pc);
+  pc = _mm256_add_ps(pc, _mm256_set1_ps(1.0f));
+  __m256 ps = _mm256_fmadd_ps(_mm256_set1_ps(SIN_P0), z, _mm256_set1_ps(SIN_P1));
+  ps = _mm256_fmadd_ps(ps, z, _mm256_set1_ps(SIN_P2));
+  ps = _mm256_fmadd_ps(_mm256_mul_ps(ps, z), a, a);
+  s = _mm256_xor_ps(_mm256_blendv_ps(pc, ps, sin_poly), sin_sign);
+  c = _mm256_xor_ps(_mm256_blendv_ps(ps, pc, sin_poly), cos_sign);
+}
+
+// The lanes that sincos8 does not handle, including NaN
+NANOFLOW_TARGET_AVX2 static inline unsigned int sincos_fallback(__m256 x) {
+  return _mm256_movemask_ps(
+      _mm256_cmp_ps(abs_ps(x), _mm256_set1_ps(scalar::math::SINCOS_MAX), _CMP_NLE_UQ));
+}
+
+NANOFLOW_TARGET_AVX2 static inline void sincos(const float* x, size_t n, float* s, float* c) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(x + i);
+    __m256 vs, vc;
+    sincos8(v, vs, vc);
+    const unsigned int fallback = sincos_fallback(v);
+    float tmp[8];
+    if (fallback) {
+      _mm256_storeu_ps(tmp, v);
+    }
+    if (s != nullptr) {
+      _mm256_storeu_ps(s + i, vs);
+      fix_lanes(fallback, tmp, s + i, [](float xi) { return std::sin(xi); });
+    }
+    if (c != nullptr) {
+      _mm256_storeu_ps(c + i, vc);
+      fix_lanes(fallback, tmp, c + i, [](float xi) { return std::cos(xi); });
+    }
+  }
+  for (; i < n; i++) {
+    float si, ci;
+    scalar::fast_sincos_one(x[i], si, ci);
+    if (s != nullptr) {
+      s[i] = si;
+    }
+    if (c != nullptr) {
+      c[i] = ci;
+    }
+  }
+}
+
+// exp(x) for x in [-87, 88]
+NANOFLOW_TARGET_AVX2 static inline __m256 exp8(__m256 x) {
+  using namespace scalar::math;
+  const __m256 fx =
+      _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(LOG2E), _mm256_set1_ps(0.5f)));
+  x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C1), x);
+  x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C2), x);
+  const __m256 z = _mm256_mul_ps(x, x);
+  __m256 y = _mm256_fmadd_ps(_mm256_set1_ps(EXP_P0), x, _mm256_set1_ps(EXP_P1));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(EXP_P2));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(EXP_P3));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(EXP_P4));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(EXP_P5));
+  y = _mm256_add_ps(_mm256_fmadd_ps(y, z, x), _mm256_set1_ps(1.0f));
+  const __m256i e = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+NANOFLOW_TARGET_AVX2 static inline void sinh(const float* x, size_t n, float* out) {
+  using namespace scalar::math;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(x + i);
+    const __m256 a = abs_ps(v);
+    const unsigned int fallback =
+        _mm256_movemask_ps(_mm256_cmp_ps(a, _mm256_set1_ps(SINH_MAX), _CMP_NLE_UQ));
+    // |x| < 1
+    const __m256 z = _mm256_mul_ps(a, a);
+    __m256 small = _mm256_fmadd_ps(_mm256_set1_ps(SINH_P0), z, _mm256_set1_ps(SINH_P1));
+    small = _mm256_fmadd_ps(small, z, _mm256_set1_ps(SINH_P2));
+    small = _mm256_fmadd_ps(_mm256_mul_ps(small, z), a, a);
+    // |x| >= 1, the large values are clamped and fixed below
+    const __m256 e = exp8(_mm256_min_ps(a, _mm256_set1_ps(SINH_MAX)));
+    const __m256 large = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), e),
+                                       _mm256_div_ps(_mm256_set1_ps(0.5f), e));
+    const __m256 r =
+        _mm256_blendv_ps(large, small, _mm256_cmp_ps(a, _mm256_set1_ps(1.0f), _CMP_LT_OQ));
+    float tmp[8];
+    if (fallback) {
+      _mm256_storeu_ps(tmp, v);
+    }
+    _mm256_storeu_ps(out + i, _mm256_or_ps(r, sign_ps(v)));
+    fix_lanes(fallback, tmp, out + i, [](float xi) { return std::sinh(xi); });
+  }
+  scalar::sinh(x + i, n - i, out + i);
+}
+
+NANOFLOW_TARGET_AVX2 static inline void atan2(const float* y, const float* x, size_t n,
+                                              float* out) {
+  using namespace scalar::math;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 vy = _mm256_loadu_ps(y + i);
+    const __m256 vx = _mm256_loadu_ps(x + i);
+    const __m256 ax = abs_ps(vx);
+    const __m256 ay = abs_ps(vy);
+    const __m256 den = _mm256_max_ps(ax, ay);
+    const __m256 num = _mm256_min_ps(ax, ay);
+    // max and min return their second operand if the first one is NaN, so
+    // the NaN inputs are checked on their own
+    const unsigned int fallback = _mm256_movemask_ps(_mm256_or_ps(
+        _mm256_or_ps(_mm256_cmp_ps(den, _mm256_setzero_ps(), _CMP_NGT_UQ),
+                     _mm256_cmp_ps(den, _mm256_set1_ps(std::numeric_limits<float>::max()),
+                                   _CMP_NLE_UQ)),
+        _mm256_cmp_ps(vx, vy, _CMP_UNORD_Q)));
+    __m256 z = _mm256_div_ps(num, den);
+    const __m256 reduce = _mm256_cmp_ps(z, _mm256_set1_ps(TAN_PI_8), _CMP_GT_OQ);
+    z = _mm256_blendv_ps(z,
+                         _mm256_div_ps(_mm256_sub_ps(z, _mm256_set1_ps(1.0f)),
+                                       _mm256_add_ps(z, _mm256_set1_ps(1.0f))),
+                         reduce);
+    const __m256 offset = _mm256_and_ps(reduce, _mm256_set1_ps(PI_4));
+    const __m256 zz = _mm256_mul_ps(z, z);
+    __m256 r = _mm256_fmadd_ps(_mm256_set1_ps(ATAN_P0), zz, _mm256_set1_ps(ATAN_P1));
+    r = _mm256_fmadd_ps(r, zz, _mm256_set1_ps(ATAN_P2));
+    r = _mm256_fmadd_ps(r, zz, _mm256_set1_ps(ATAN_P3));
+    r = _mm256_add_ps(_mm256_fmadd_ps(_mm256_mul_ps(r, zz), z, z), offset);
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_2), r),
+                         _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI), r), vx);
+    r = _mm256_or_ps(r, sign_ps(vy));
+    _mm256_storeu_ps(out + i, r);
+    if (fallback) {
+      float tmpy[8], tmpx[8];
+      _mm256_storeu_ps(tmpy, vy);
+      _mm256_storeu_ps(tmpx, vx);
+      for (unsigned int m = fallback; m; m &= m - 1) {
+        const int k = __builtin_ctz(m);
+        out[i + k] = std::atan2(tmpy[k], tmpx[k]);
+      }
+    }
+  }
+  scalar::atan2(y + i, x + i, n - i, out + i);
+}
+
+NANOFLOW_TARGET_AVX2 static inline void sqrt(const float* x, size_t n, float* out) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_sqrt_ps(_mm256_loadu_ps(x + i)));
+  }
+  scalar::sqrt(x + i, n - i, out + i);
+}
+
+NANOFLOW_TARGET_AVX2 static inline void log(const float* x, size_t n, float* out) {
+  using namespace scalar::math;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(x + i);
+    const unsigned int fallback = _mm256_movemask_ps(_mm256_or_ps(
+        _mm256_cmp_ps(v, _mm256_set1_ps(std::numeric_limits<float>::min()), _CMP_NGE_UQ),
+        _mm256_cmp_ps(v, _mm256_set1_ps(std::numeric_limits<float>::max()), _CMP_NLE_UQ)));
+    const __m256i bits = _mm256_castps_si256(v);
+    __m256 e = _mm256_cvtepi32_ps(
+        _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0x7f - 1)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(~0x7f800000)), _mm256_set1_epi32(0x3f000000)));
+    const __m256 below = _mm256_cmp_ps(m, _mm256_set1_ps(SQRTHF), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(below, _mm256_set1_ps(1.0f)));
+    m = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(below, m)), _mm256_set1_ps(1.0f));
+    const __m256 z = _mm256_mul_ps(m, m);
+    __m256 y = _mm256_fmadd_ps(_mm256_set1_ps(LOG_P0), m, _mm256_set1_ps(LOG_P1));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P2));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P3));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P4));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P5));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P6));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P7));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P8));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+    y = _mm256_fmadd_ps(e, _mm256_set1_ps(EXP_C2), y);
+    y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, y);
+    const __m256 r = _mm256_fmadd_ps(e, _mm256_set1_ps(EXP_C1), _mm256_add_ps(m, y));
+    float tmp[8];
+    if (fallback) {
+      _mm256_storeu_ps(tmp, v);
+    }
+    _mm256_storeu_ps(out + i, r);
+    fix_lanes(fallback, tmp, out + i, [](float xi) { return std::log(xi); });
+  }
+  scalar::log(x + i, n - i, out + i);
+}
+
+}  // namespace avx2
+
+namespace avx512 {
+
+NANOFLOW_TARGET_AVX512 static inline __m512 and_ps(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+NANOFLOW_TARGET_AVX512 static inline __m512 xor_ps(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+NANOFLOW_TARGET_AVX512 static inline __m512 abs_ps(__m512 x) {
+  return and_ps(x, _mm512_castsi512_ps(_mm512_set1_epi32(0x7fffffff)));
+}
+
+NANOFLOW_TARGET_AVX512 static inline __m512 sign_ps(__m512 x) {
+  return and_ps(x, _mm512_castsi512_ps(_mm512_set1_epi32(0x80000000)));
+}
+
+NANOFLOW_TARGET_AVX512 static inline void sincos16(__m512 x, __m512& s, __m512& c) {
+  using namespace scalar::math;
+  __m512 a = abs_ps(x);
+  __m512i j = _mm512_maskz_cvttps_epi32(0xffff, _mm512_mul_ps(a, _mm512_set1_ps(FOPI)));
+  j = _mm512_and_si512(_mm512_add_epi32(j, _mm512_set1_epi32(1)), _mm512_set1_epi32(~1));
+  const __m512 y = _mm512_maskz_cvtepi32_ps(0xffff, j);
+  const __mmask16 sin_poly = _mm512_testn_epi32_mask(j, _mm512_set1_epi32(2));
+  const __m512i sin_bit =
+      _mm512_maskz_slli_epi32(0xffff, _mm512_and_si512(j, _mm512_set1_epi32(4)), 29);
+  const __m512i cos_bit = _mm512_maskz_slli_epi32(
+      0xffff,
+      _mm512_maskz_andnot_epi32(0xffff, _mm512_sub_epi32(j, _mm512_set1_epi32(2)),
+                                _mm512_set1_epi32(4)),
+      29);
+  const __m512 sin_sign = xor_ps(sign_ps(x), _mm512_castsi512_ps(sin_bit));
+  const __m512 cos_sign = _mm512_castsi512_ps(cos_bit);
+  a = _mm512_fnmadd_ps(y, _mm512_set1_ps(DP1), a);
+  a = _mm512_fnmadd_ps(y, _mm512_set1_ps(DP2), a);
+  a = _mm512_fnmadd_ps(y, _mm512_set1_ps(DP3), a);
+  const __m512 z = _mm512_mul_ps(a, a);
+  __m512 pc = _mm512_fmadd_ps(_mm512_set1_ps(COS_P0), z, _mm512_set1_ps(COS_P1));
+  pc = _mm512_fmadd_ps(pc, z, _mm512_set1_ps(COS_P2));
+  pc = _mm512_mul_ps(_mm512_mul_ps(pc, z), z);
+  pc = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, pc);
+  pc = _mm512_add_ps(pc, _mm512_set1_ps(1.0f));
+  __m512 ps = _mm512_fmadd_ps(_mm512_set1_ps(SIN_P0), z, _mm512_set1_ps(SIN_P1));
+  ps = _mm512_fmadd_ps(ps, z, _mm512_set1_ps(SIN_P2));
+  ps = _mm512_fmadd_ps(_mm512_mul_ps(ps, z), a, a);
+  s = xor_ps(_mm512_mask_blend_ps(sin_poly, pc, ps), sin_sign);
+  c = xor_ps(_mm512_mask_blend_ps(sin_poly, ps, pc), cos_sign);
+}
+
+NANOFLOW_TARGET_AVX512 static inline void sincos(const float* x, size_t n, float* s, float* c) {
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 v = _mm512_maskz_loadu_ps(lanes, x + i);
+    __m512 vs, vc;
+    sincos16(v, vs, vc);
+    const unsigned int fallback =
+        _mm512_mask_cmp_ps_mask(lanes, abs_ps(v), _mm512_set1_ps(scalar::math::SINCOS_MAX),
+                                _CMP_NLE_UQ);
+    float tmp[16];
+    if (fallback) {
+      _mm512_storeu_ps(tmp, v);
+    }
+    if (s != nullptr) {
+      _mm512_mask_storeu_ps(s + i, lanes, vs);
+      avx2::fix_lanes(fallback, tmp, s + i, [](float xi) { return std::sin(xi); });
+    }
+    if (c != nullptr) {
+      _mm512_mask_storeu_ps(c + i, lanes, vc);
+      avx2::fix_lanes(fallback, tmp, c + i, [](float xi) { return std::cos(xi); });
+    }
+  }
+}
+
+// exp(x) for x in [-87, 88]
+NANOFLOW_TARGET_AVX512 static inline __m512 exp16(__m512 x) {
+  using namespace scalar::math;
+  const __m512 fx = _mm512_maskz_roundscale_ps(
+      0xffff, _mm512_fmadd_ps(x, _mm512_set1_ps(LOG2E), _mm512_set1_ps(0.5f)),
+      _MM_FROUND_TO_NEG_INF);
+  x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C1), x);
+  x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C2), x);
+  const __m512 z = _mm512_mul_ps(x, x);
+  __m512 y = _mm512_fmadd_ps(_mm512_set1_ps(EXP_P0), x, _mm512_set1_ps(EXP_P1));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P2));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P3));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P4));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P5));
+  y = _mm512_add_ps(_mm512_fmadd_ps(y, z, x), _mm512_set1_ps(1.0f));
+  const __m512i e = _mm512_maskz_slli_epi32(
+      0xffff, _mm512_add_epi32(_mm512_maskz_cvttps_epi32(0xffff, fx), _mm512_set1_epi32(127)),
+      23);
+  return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+}
+
+NANOFLOW_TARGET_AVX512 static inline void sinh(const float* x, size_t n, float* out) {
+  using namespace scalar::math;
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 v = _mm512_maskz_loadu_ps(lanes, x + i);
+    const __m512 a = abs_ps(v);
+    const unsigned int fallback =
+        _mm512_mask_cmp_ps_mask(lanes, a, _mm512_set1_ps(SINH_MAX), _CMP_NLE_UQ);
+    const __m512 z = _mm512_mul_ps(a, a);
+    __m512 small = _mm512_fmadd_ps(_mm512_set1_ps(SINH_P0), z, _mm512_set1_ps(SINH_P1));
+    small = _mm512_fmadd_ps(small, z, _mm512_set1_ps(SINH_P2));
+    small = _mm512_fmadd_ps(_mm512_mul_ps(small, z), a, a);
+    const __m512 e = exp16(_mm512_maskz_min_ps(0xffff, a, _mm512_set1_ps(SINH_MAX)));
+    const __m512 large = _mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), e),
+                                       _mm512_div_ps(_mm512_set1_ps(0.5f), e));
+    const __mmask16 is_small = _mm512_cmp_ps_mask(a, _mm512_set1_ps(1.0f), _CMP_LT_OQ);
+    const __m512 r = _mm512_mask_blend_ps(is_small, large, small);
+    float tmp[16];
+    if (fallback) {
+      _mm512_storeu_ps(tmp, v);
+    }
+    _mm512_mask_storeu_ps(out + i, lanes, xor_ps(r, sign_ps(v)));
+    avx2::fix_lanes(fallback, tmp, out + i, [](float xi) { return std::sinh(xi); });
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void atan2(const float* y, const float* x, size_t n,
+                                                float* out) {
+  using namespace scalar::math;
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 vy = _mm512_maskz_loadu_ps(lanes, y + i);
+    const __m512 vx = _mm512_maskz_loadu_ps(lanes, x + i);
+    const __m512 ax = abs_ps(vx);
+    const __m512 ay = abs_ps(vy);
+    const __m512 den = _mm512_maskz_max_ps(0xffff, ax, ay);
+    const __m512 num = _mm512_maskz_min_ps(0xffff, ax, ay);
+    // max and min return their second operand if the first one is NaN, so
+    // the NaN inputs are checked on their own
+    const unsigned int fallback =
+        _mm512_mask_cmp_ps_mask(lanes, den, _mm512_setzero_ps(), _CMP_NGT_UQ) |
+        _mm512_mask_cmp_ps_mask(lanes, den, _mm512_set1_ps(std::numeric_limits<float>::max()),
+                                _CMP_NLE_UQ) |
+        _mm512_mask_cmp_ps_mask(lanes, vx, vy, _CMP_UNORD_Q);
+    __m512 z = _mm512_div_ps(num, den);
+    const __mmask16 reduce = _mm512_cmp_ps_mask(z, _mm512_set1_ps(TAN_PI_8), _CMP_GT_OQ);
+    z = _mm512_mask_div_ps(z, reduce, _mm512_sub_ps(z, _mm512_set1_ps(1.0f)),
+                           _mm512_add_ps(z, _mm512_set1_ps(1.0f)));
+    const __m512 offset = _mm512_maskz_mov_ps(reduce, _mm512_set1_ps(PI_4));
+    const __m512 zz = _mm512_mul_ps(z, z);
+    __m512 r = _mm512_fmadd_ps(_mm512_set1_ps(ATAN_P0), zz, _mm512_set1_ps(ATAN_P1));
+    r = _mm512_fmadd_ps(r, zz, _mm512_set1_ps(ATAN_P2));
+    r = _mm512_fmadd_ps(r, zz, _mm512_set1_ps(ATAN_P3));
+    r = _mm512_add_ps(_mm512_fmadd_ps(_mm512_mul_ps(r, zz), z, z), offset);
+    r = _mm512_mask_sub_ps(r, _mm512_cmp_ps_mask(ay, ax, _CMP_GT_OQ), _mm512_set1_ps(PI_2), r);
+    const __mmask16 x_negative = _mm512_test_epi32_mask(_mm512_castps_si512(vx),
+                                                        _mm512_set1_epi32(0x80000000));
+    r = _mm512_mask_sub_ps(r, x_negative, _mm512_set1_ps(PI), r);
+    r = xor_ps(r, sign_ps(vy));
+    _mm512_mask_storeu_ps(out + i, lanes, r);
+    if (fallback) {
+      float tmpy[16], tmpx[16];
+      _mm512_storeu_ps(tmpy, vy);
+      _mm512_storeu_ps(tmpx, vx);
+      for (unsigned int m = fallback; m; m &= m - 1) {
+        const int k = __builtin_ctz(m);
+        out[i + k] = std::atan2(tmpy[k], tmpx[k]);
+      }
+    }
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void sqrt(const float* x, size_t n, float* out) {
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 v = _mm512_maskz_loadu_ps(lanes, x + i);
+    _mm512_mask_storeu_ps(out + i, lanes, _mm512_maskz_sqrt_ps(lanes, v));
+  }
+}
+
+NANOFLOW_TARGET_AVX512 static inline void log(const float* x, size_t n, float* out) {
+  using namespace scalar::math;
+  for (size_t i = 0; i < n; i += 16) {
+    const __mmask16 lanes = lane_mask(n - i);
+    const __m512 v = _mm512_maskz_loadu_ps(lanes, x + i);
+    const unsigned int fallback =
+        _mm512_mask_cmp_ps_mask(lanes, v, _mm512_set1_ps(std::numeric_limits<float>::min()),
+                                _CMP_NGE_UQ) |
+        _mm512_mask_cmp_ps_mask(lanes, v, _mm512_set1_ps(std::numeric_limits<float>::max()),
+                                _CMP_NLE_UQ);
+    const __m512i bits = _mm512_castps_si512(v);
+    __m512 e = _mm512_maskz_cvtepi32_ps(
+        0xffff,
+        _mm512_sub_epi32(_mm512_maskz_srli_epi32(0xffff, bits, 23), _mm512_set1_epi32(0x7f - 1)));
+    __m512 m = _mm512_castsi512_ps(_mm512_or_si512(
+        _mm512_and_si512(bits, _mm512_set1_epi32(~0x7f800000)), _mm512_set1_epi32(0x3f000000)));
+    const __mmask16 below = _mm512_cmp_ps_mask(m, _mm512_set1_ps(SQRTHF), _CMP_LT_OQ);
+    e = _mm512_mask_sub_ps(e, below, e, _mm512_set1_ps(1.0f));
+    m = _mm512_sub_ps(_mm512_mask_add_ps(m, below, m, m), _mm512_set1_ps(1.0f));
+    const __m512 z = _mm512_mul_ps(m, m);
+    __m512 y = _mm512_fmadd_ps(_mm512_set1_ps(LOG_P0), m, _mm512_set1_ps(LOG_P1));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P2));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P3));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P4));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P5));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P6));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P7));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P8));
+    y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+    y = _mm512_fmadd_ps(e, _mm512_set1_ps(EXP_C2), y);
+    y = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, y);
+    const __m512 r = _mm512_fmadd_ps(e, _mm512_set1_ps(EXP_C1), _mm512_add_ps(m, y));
+    float tmp[16];
+    if (fallback) {
+      _mm512_storeu_ps(tmp, v);
+    }
+    _mm512_mask_storeu_ps(out + i, lanes, r);
+    avx2::fix_lanes(fallback, tmp, out + i, [](float xi) { return std::log(xi); });
+  }
+}
+
+}  // namespace avx512
+
+#endif  // NANOFLOW_SIMD_X86
+
+// In the exact mode, the functions are plain loops over the standard library
+// functions, which the compiler can vectorize if the library has vector
+// versions of them (e.g. with -ffast-math and glibc's libmvec)
+
+// sin(x[i]) and cos(x[i]), s or c can be nullptr if not needed
+// Without vector instructions, the fast mode of sin, cos and log calls libm,
+// which is faster than the scalar polynomials (the scalar polynomials are
+// still used for the remainders of the vector loops)
+static inline void sincos(const float* x, size_t n, float* s, float* c,
+                          MathMode mode = MathMode::Exact) {
+  if (mode == MathMode::Exact || active_isa() == ISA::Scalar) {
+    for (size_t i = 0; i < n; i++) {
+      const float xi = x[i];
+      if (s != nullptr) {
+        s[i] = std::sin(xi);
+      }
+      if (c != nullptr) {
+        c[i] = std::cos(xi);
+      }
+    }
+    return;
+  }
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::sincos(x, n, s, c);
+    case ISA::AVX2:
+      return avx2::sincos(x, n, s, c);
+#endif
+    default:
+      return scalar::sincos(x, n, s, c);
+  }
+}
+
+static inline void sin(const float* x, size_t n, float* out, MathMode mode = MathMode::Exact) {
+  sincos(x, n, out, nullptr, mode);
+}
+
+static inline void cos(const float* x, size_t n, float* out, MathMode mode = MathMode::Exact) {
+  sincos(x, n, nullptr, out, mode);
+}
+
+static inline void sinh(const float* x, size_t n, float* out, MathMode mode = MathMode::Exact) {
+  if (mode == MathMode::Exact) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = std::sinh(x[i]);
+    }
+    return;
+  }
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::sinh(x, n, out);
+    case ISA::AVX2:
+      return avx2::sinh(x, n, out);
+#endif
+    default:
+      return scalar::sinh(x, n, out);
+  }
+}
+
+// atan2(y[i], x[i]), e.g. the phi of (px, py) is atan2(py, px, n, phi)
+static inline void atan2(const float* y, const float* x, size_t n, float* out,
+                         MathMode mode = MathMode::Exact) {
+  if (mode == MathMode::Exact) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = std::atan2(y[i], x[i]);
+    }
+    return;
+  }
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::atan2(y, x, n, out);
+    case ISA::AVX2:
+      return avx2::atan2(y, x, n, out);
+#endif
+    default:
+      return scalar::atan2(y, x, n, out);
+  }
+}
+
+// The fast mode uses the vector square root instructions, which are correctly
+// rounded like std::sqrt, but do not set errno for negative values
+static inline void sqrt(const float* x, size_t n, float* out, MathMode mode = MathMode::Exact) {
+  if (mode == MathMode::Exact) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = std::sqrt(x[i]);
+    }
+    return;
+  }
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::sqrt(x, n, out);
+    case ISA::AVX2:
+      return avx2::sqrt(x, n, out);
+#endif
+    default:
+      return scalar::sqrt(x, n, out);
+  }
+}
+
+static inline void log(const float* x, size_t n, float* out, MathMode mode = MathMode::Exact) {
+  if (mode == MathMode::Exact || active_isa() == ISA::Scalar) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = std::log(x[i]);
+    }
+    return;
+  }
+  switch (active_isa()) {
+#if NANOFLOW_SIMD_X86
+    case ISA::AVX512:
+      return avx512::log(x, n, out);
+    case ISA::AVX2:
+      return avx2::log(x, n, out);
+#endif
+    default:
+      return scalar::log(x, n, out);
+  }
+}
+
+}  // namespace simd
+}  // namespace nanoflow
+
+#endif
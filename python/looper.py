@@ -20,6 +20,10 @@ def run_looper(input_json, output_json):
 
     print("Adding MuonEventAnalyzer")   
     an.add(ROOT.MuonEventAnalyzer(an.output))
+    print("Adding MuonFilterAnalyzer")   
+    an.add(ROOT.MuonFilterAnalyzer(1))
+    print("Adding MuonGenMatchAnalyzer")   
+    an.add(ROOT.MuonGenMatchAnalyzer())
     print("Adding MyTreeAnalyzer")   
     an.add(ROOT.MyTreeAnalyzer(an.output))
     
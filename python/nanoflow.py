@@ -184,6 +184,7 @@ class Dataset:
                     "output_filename": _outfile,
                     "max_events": -1,
                     "report_period": 10000,
+                    "branch_learn_events": 100,
                 }
                 fi.write(json.dumps(job_json, indent=2))
             ijob += 1
@@ -397,6 +398,15 @@ def load_lib(path):
     if ret != 0:
         raise Exception("Could not load library {0}".format(path))
 
+def generate_schema(input_file, output_header, struct_name, patterns=[], codegen="bin/nf_codegen"):
+    """Generates a typed event struct for the branches of input_file that match
+    the glob patterns (all branches by default) using the nf_codegen binary,
+    the resulting header can be loaded using load_header.
+    """
+    cmd = [codegen, input_file, output_header, struct_name] + list(patterns)
+    logging.info("generating schema: {0}".format(" ".join(cmd)))
+    subprocess.check_call(cmd)
+    return output_header
 
 def FileReport_to_dict(p):
     r = {
@@ -407,8 +417,13 @@ def FileReport_to_dict(p):
         "speed": p.speed,
         "event_duration": p.event_duration,
         "analyzer_durations": list(p.analyzer_durations),
-        "analyzer_names": list(p.analyzer_names)
+        "untimed_analyzer_duration": p.untimed_analyzer_duration,
+        "analyzer_names": list(p.analyzer_names),
+        "analyzer_num_passed": list(p.analyzer_num_passed)
     }
+    if p.io_timed:
+        r["io_wait_duration"] = p.io_wait_duration
+        r["io_hidden_duration"] = p.io_hidden_duration
     return r
 
 class SequentialAnalysis:
@@ -418,7 +433,12 @@ class SequentialAnalysis:
         self.modules = []
         
         self.conf = ROOT.nanoflow.Configuration(input_json)
+        if self.conf.prefetch:
+            ROOT.nanoflow.enable_async_prefetch()
         self.output = ROOT.nanoflow.Output(self.conf.output_filename)
+        self.output.async_ring_size = self.conf.async_output
+        if self.conf.imt_threads > 0:
+            ROOT.ROOT.EnableImplicitMT(self.conf.imt_threads)
 
         vector_Analyzer = getattr(ROOT, "std::vector<nanoflow::Analyzer*>")
         self.analyzers = vector_Analyzer()
@@ -31,35 +31,67 @@ int main(int argc, char* argv[]) {
   //     std::make_unique<Output>(conf.output_filename);
   Output output(conf.output_filename);
 
+  // Fill the output TTree in a background thread, optionally compressing the
+  // baskets in parallel with ROOT implicit multithreading
+  output.async_ring_size = conf.async_output;
+  if (conf.imt_threads > 0) {
+    ROOT::EnableImplicitMT(conf.imt_threads);
+  }
+
   // Define the sequence of analyzers you want to run
-  // These are defined in the myanalyzers.h/myanalyzers.cc files
+  // These are defined in demoanalysis.h. Since the sequence is known at
+  // compile time, we use a Pipeline instead of a vector<Analyzer*>, which
+  // allows the compiler to inline the analyzers into the event loop.
+  // The events without muons are not processed further.
   cout << "Creating Analyzers" << endl;
-  vector<Analyzer*> analyzers = {
-      new MuonEventAnalyzer(output),
-      new MyTreeAnalyzer(output)
-  };
+  MuonEventAnalyzer muon_analyzer(output);
+  MuonFilterAnalyzer muon_filter(1);
+  MuonGenMatchAnalyzer muon_match;
+  MyTreeAnalyzer tree_analyzer(output);
+  Pipeline<MyAnalysisEvent, MuonEventAnalyzer, MuonFilterAnalyzer, MuonGenMatchAnalyzer,
+           MyTreeAnalyzer>
+      pipeline(muon_analyzer, muon_filter, muon_match, tree_analyzer);
+
+  // Read ahead the input files in the background, this must be done before
+  // the files are opened
+  if (conf.prefetch) {
+    enable_async_prefetch();
+  }
 
   // Define the final output report
   json total_report;
 
-  // Loop over all the input files
-  for (const auto& input_file : conf.input_files) {
-    cout << "Opening input file " << input_file << endl;
-    TFile* tf = TFile::Open(input_file.c_str());
-    if (tf == nullptr) {
-      cerr << "Could not open file " << input_file << ", exiting" << endl;
-      return 1;
+  if (conf.num_threads > 1) {
+    // With several threads, all the files are split into parts which are
+    // distributed to the threads, each thread runs its own clones of the
+    // analyzers
+    const vector<Analyzer*> analyzers = {&muon_analyzer, &muon_filter, &muon_match,
+                                         &tree_analyzer};
+    auto reports = looper_files_mt<MyAnalysisEvent, Configuration>(conf, conf.input_files, output, analyzers);
+    for (auto& report : reports) {
+      report.print(cout);
+      total_report.push_back(report);
+    }
+  } else {
+    // Loop over all the input files
+    for (const auto& input_file : conf.input_files) {
+      cout << "Opening input file " << input_file << endl;
+      TFile* tf = TFile::Open(input_file.c_str());
+      if (tf == nullptr) {
+        cerr << "Could not open file " << input_file << ", exiting" << endl;
+        return 1;
+      }
+
+      // Inititalize the input TTree
+      TTreeReader reader("Events", tf);
+
+      // call the main loop
+      auto report = looper_main<MyAnalysisEvent, Configuration>(conf, reader, output, pipeline);
+      report.print(cout);
+
+      total_report.push_back(report);
+      tf->Close();
     }
-
-    // Inititalize the input TTree
-    TTreeReader reader("Events", tf);
-
-    // call the main loop
-    auto report = looper_main<MyAnalysisEvent, Configuration>(conf, reader, output, analyzers);
-    report.print(cout);
-
-    total_report.push_back(report);
-    tf->Close();
   }
   cout << "All input files processed, saving output" << endl;
   output.close();
@@ -0,0 +1,280 @@
+// Generates a C++ header with a strongly typed event struct from the branches
+// of a NanoAOD file. Analyses compiled against the generated header access
+// the branches with compile-time types and without any string hashing, e.g.
+//
+//   MyEventSchema data(reader);
+//   while (reader.Next()) {
+//     for (unsigned int i = 0; i < data.Muon.size(); i++) {
+//       const auto pt = data.Muon.pt[i];
+//     }
+//   }
+//
+// Array branches named like Muon_pt with a length branch nMuon are grouped to
+// collections with the fields pt, eta, ... All other branches become plain
+// members.
+//
+// Usage: ./bin/nf_codegen input.root output.h StructName [pattern ...]
+// where the optional patterns (e.g. "Muon_*" "run") select the branches to
+// include, by default all branches are included.
+
+#include <fnmatch.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <TFile.h>
+#include <TLeaf.h>
+#include <TROOT.h>
+#include <TTree.h>
+
+#include "nanoflow.h"
+
+using namespace nanoflow;
+
+// A branch of the input TTree
+class LeafDesc {
+ public:
+  string name;
+  string type_name;
+  // the name of the branch holding the array length, empty for values
+  string count_name;
+  bool is_array;
+};
+
+// A group of arrays with the same length branch and name prefix, e.g. Muon_*
+class CollectionDesc {
+ public:
+  string name;
+  string count_name;
+  string count_type;
+  // pairs of (field name, leaf)
+  vector<pair<string, LeafDesc>> fields;
+};
+
+static bool matches_any(const string& name, const vector<string>& patterns) {
+  if (patterns.empty()) {
+    return true;
+  }
+  for (const auto& pattern : patterns) {
+    if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Makes sure the branch name is a valid C++ identifier
+static string sanitize(const string& name) {
+  static const set<string> keywords = {
+      "auto", "bool", "break", "case", "char", "class", "const", "default",
+      "delete", "do", "double", "else", "enum", "float", "for", "if", "int",
+      "long", "new", "private", "public", "return", "short", "signed",
+      "sizeof", "static", "struct", "switch", "this", "unsigned", "void",
+      "while", "size", "n"};
+  string ret;
+  for (char c : name) {
+    ret += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  if (ret.empty() || isdigit(static_cast<unsigned char>(ret[0]))) {
+    ret = "_" + ret;
+  }
+  if (keywords.find(ret) != keywords.end()) {
+    ret += "_";
+  }
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  gROOT->SetBatch(true);
+
+  if (argc < 4) {
+    cerr << "Usage: ./nf_codegen input.root output.h StructName [pattern ...]" << endl;
+    return 0;
+  }
+  const string input_filename(argv[1]);
+  const string output_filename(argv[2]);
+  const string struct_name(argv[3]);
+  vector<string> patterns;
+  for (int i = 4; i < argc; i++) {
+    patterns.push_back(argv[i]);
+  }
+
+  TFile* tf = TFile::Open(input_filename.c_str());
+  if (tf == nullptr) {
+    cerr << "Could not open file " << input_filename << ", exiting" << endl;
+    return 1;
+  }
+  TTree* tree = nullptr;
+  tf->GetObject("Events", tree);
+  if (tree == nullptr) {
+    cerr << "Could not find the Events TTree in " << input_filename << ", exiting" << endl;
+    return 1;
+  }
+
+  // Walk the leaves in the same way as NanoEvent does
+  map<string, LeafDesc> all_leaves;
+  vector<string> leaf_order;
+  for (auto leaf_obj : *tree->GetListOfLeaves()) {
+    TLeaf* leaf = (TLeaf*)leaf_obj;
+    LeafDesc desc;
+    desc.name = leaf->GetName();
+    desc.type_name = leaf->GetTypeName();
+    desc.count_name = leaf->GetLeafCount() != nullptr ? leaf->GetLeafCount()->GetName() : "";
+    desc.is_array = leaf->GetLeafCount() != nullptr || leaf->GetLenStatic() > 1;
+    if (parse_leaf_dtype(desc.type_name) == LeafDType::Unknown) {
+      cerr << "Skipping branch " << desc.name << " with unsupported type " << desc.type_name << endl;
+      continue;
+    }
+    all_leaves[desc.name] = desc;
+    leaf_order.push_back(desc.name);
+  }
+
+  // Select the branches, together with the length branches of the arrays
+  vector<LeafDesc> selected;
+  set<string> selected_names;
+  for (const auto& name : leaf_order) {
+    const auto& desc = all_leaves.at(name);
+    if (!matches_any(name, patterns)) {
+      continue;
+    }
+    if (!desc.count_name.empty() && selected_names.find(desc.count_name) == selected_names.end() &&
+        all_leaves.find(desc.count_name) != all_leaves.end()) {
+      selected.push_back(all_leaves.at(desc.count_name));
+      selected_names.insert(desc.count_name);
+    }
+    if (selected_names.find(name) == selected_names.end()) {
+      selected.push_back(desc);
+      selected_names.insert(name);
+    }
+  }
+
+  // Group the arrays to collections: Muon_pt[nMuon] goes to Muon.pt
+  map<string, CollectionDesc> collections;
+  vector<string> collection_order;
+  vector<LeafDesc> plain;
+  for (const auto& desc : selected) {
+    const auto underscore = desc.name.find('_');
+    const string prefix = underscore != string::npos ? desc.name.substr(0, underscore) : "";
+    if (desc.is_array && !prefix.empty() && desc.count_name == "n" + prefix) {
+      auto& coll = collections[prefix];
+      if (coll.name.empty()) {
+        coll.name = prefix;
+        coll.count_name = desc.count_name;
+        coll.count_type = all_leaves.at(desc.count_name).type_name;
+        collection_order.push_back(prefix);
+      }
+      coll.fields.push_back(make_pair(sanitize(desc.name.substr(underscore + 1)), desc));
+    } else {
+      plain.push_back(desc);
+    }
+  }
+
+  // The sanitized names have to be unique, e.g. Jet_pt and Jet.pt would both
+  // become Jet_pt
+  const auto is_collection_count = [&collections](const LeafDesc& desc) {
+    return desc.name.size() > 1 && desc.name[0] == 'n' &&
+           collections.find(desc.name.substr(1)) != collections.end();
+  };
+  map<string, string> identifiers;
+  const auto add_identifier = [&identifiers](const string& identifier, const string& name) {
+    const auto it = identifiers.find(identifier);
+    if (it != identifiers.end()) {
+      cerr << "The branches " << it->second << " and " << name
+           << " both map to the identifier " << identifier << ", exiting" << endl;
+      return false;
+    }
+    identifiers[identifier] = name;
+    return true;
+  };
+  for (const auto& coll_name : collection_order) {
+    if (!add_identifier(sanitize(coll_name), coll_name + "_*") ||
+        !add_identifier(sanitize(coll_name) + "Collection", coll_name + "_*")) {
+      return 1;
+    }
+  }
+  for (const auto& desc : plain) {
+    if (!is_collection_count(desc) && !add_identifier(sanitize(desc.name), desc.name)) {
+      return 1;
+    }
+  }
+  for (const auto& coll_name : collection_order) {
+    identifiers.clear();
+    for (const auto& field : collections.at(coll_name).fields) {
+      if (!add_identifier(coll_name + "." + field.first, field.second.name)) {
+        return 1;
+      }
+    }
+  }
+
+  ofstream out(output_filename);
+  if (!out) {
+    cerr << "Could not open " << output_filename << " for writing, exiting" << endl;
+    return 1;
+  }
+  const string guard = "NANOFLOW_SCHEMA_" + sanitize(struct_name) + "_H";
+  out << "// Generated by nf_codegen from " << input_filename << ", do not edit\n";
+  out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+  out << "#include <TTreeReader.h>\n#include <TTreeReaderArray.h>\n#include <TTreeReaderValue.h>\n\n";
+  out << "// The typed branches of the Events TTree\n";
+  out << "struct " << struct_name << " {\n";
+
+  for (const auto& coll_name : collection_order) {
+    const auto& coll = collections.at(coll_name);
+    const string coll_type = sanitize(coll.name) + "Collection";
+    out << "  // The " << coll.name << " collection, with the length in " << coll.count_name << "\n";
+    out << "  struct " << coll_type << " {\n";
+    out << "    TTreeReaderValue<" << coll.count_type << "> n;\n";
+    for (const auto& field : coll.fields) {
+      out << "    TTreeReaderArray<" << field.second.type_name << "> " << field.first << ";\n";
+    }
+    out << "\n    " << coll_type << "(TTreeReader& reader)\n";
+    out << "        : n(reader, \"" << coll.count_name << "\")";
+    for (const auto& field : coll.fields) {
+      out << ",\n          " << field.first << "(reader, \"" << field.second.name << "\")";
+    }
+    out << " {}\n\n";
+    out << "    inline unsigned int size() { return *n; }\n";
+    out << "  } " << sanitize(coll.name) << ";\n\n";
+  }
+
+  // The length branches are part of the collections
+  for (const auto& desc : plain) {
+    if (is_collection_count(desc)) {
+      continue;
+    }
+    const string reader_type = desc.is_array ? "TTreeReaderArray" : "TTreeReaderValue";
+    out << "  " << reader_type << "<" << desc.type_name << "> " << sanitize(desc.name) << ";\n";
+  }
+
+  out << "\n  " << struct_name << "(TTreeReader& reader)";
+  bool first = true;
+  for (const auto& coll_name : collection_order) {
+    out << (first ? "\n      : " : ",\n        ") << sanitize(coll_name) << "(reader)";
+    first = false;
+  }
+  for (const auto& desc : plain) {
+    if (is_collection_count(desc)) {
+      continue;
+    }
+    out << (first ? "\n      : " : ",\n        ") << sanitize(desc.name) << "(reader, \"" << desc.name << "\")";
+    first = false;
+  }
+  out << " {}\n";
+  out << "};\n\n#endif\n";
+  out.close();
+  if (!out) {
+    cerr << "Could not write " << output_filename << ", exiting" << endl;
+    return 1;
+  }
+
+  cout << "Wrote " << struct_name << " with " << collection_order.size()
+       << " collections and " << selected.size() << " branches to "
+       << output_filename << endl;
+
+  tf->Close();
+  return 0;
+}
@@ -0,0 +1,220 @@
+// Benchmarks the batched math functions of nanoflow_simd.h against libm, on
+// values distributed like the kinematics of NanoAOD objects, and measures
+// their maximum error in ULP against double precision, both on the NanoAOD
+// values and over the full range of each function. It also checks that the
+// segmented max and argmax of each ISA agree with the scalar kernels on
+// jagged inputs with NaNs, and returns 1 if they do not.
+//
+// Usage: ./bin/nf_mathbench [num_values] [num_repeats]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "nanoflow_simd.h"
+
+using namespace std;
+using namespace nanoflow;
+
+// The distance of two floats in units in the last place
+static int64_t ulp_distance(float a, float b) {
+  if (std::isnan(a) || std::isnan(b)) {
+    return (std::isnan(a) && std::isnan(b)) ? 0 : INT64_MAX;
+  }
+  int32_t ia, ib;
+  std::memcpy(&ia, &a, sizeof(float));
+  std::memcpy(&ib, &b, sizeof(float));
+  // map the floats to integers that are ordered like the floats
+  const int64_t oa = ia < 0 ? int64_t(INT32_MIN) - ia : ia;
+  const int64_t ob = ib < 0 ? int64_t(INT32_MIN) - ib : ib;
+  return std::abs(oa - ob);
+}
+
+// The input values of a function, with up to two arguments
+class Inputs {
+ public:
+  vector<float> x;
+  vector<float> y;
+};
+
+// A function to benchmark: its batched version and its double precision
+// reference
+class Function {
+ public:
+  string name;
+  function<void(const Inputs&, float*, simd::MathMode)> batch;
+  function<double(float, float)> reference;
+  // the values like in NanoAOD
+  Inputs nanoaod;
+  // values over the full range of the fast approximation
+  Inputs full_range;
+};
+
+static int64_t max_ulp(const Function& f, const Inputs& inputs, simd::MathMode mode) {
+  vector<float> out(inputs.x.size());
+  f.batch(inputs, out.data(), mode);
+  int64_t ret = 0;
+  for (size_t i = 0; i < out.size(); i++) {
+    const float ref = static_cast<float>(
+        f.reference(inputs.x[i], inputs.y.empty() ? 0.0f : inputs.y[i]));
+    ret = std::max(ret, ulp_distance(out[i], ref));
+  }
+  return ret;
+}
+
+// The best time per value in nanoseconds
+static double time_per_value(const Function& f, const Inputs& inputs, simd::MathMode mode,
+                             int num_repeats) {
+  vector<float> out(inputs.x.size());
+  double best = 1e30;
+  for (int irep = 0; irep < num_repeats; irep++) {
+    const auto t0 = chrono::high_resolution_clock::now();
+    f.batch(inputs, out.data(), mode);
+    const auto t1 = chrono::high_resolution_clock::now();
+    best = std::min(best, chrono::duration<double, std::nano>(t1 - t0).count());
+  }
+  return best / inputs.x.size();
+}
+
+// The number of events for which segmented_max or segmented_argmax of the
+// active ISA differ from the scalar kernels, on events of 0 to 40 values of
+// which about 5% are NaN
+static size_t segmented_mismatches(mt19937& rng) {
+  uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  uniform_int_distribution<unsigned int> length(0, 40);
+  const size_t num_events = 100000;
+  vector<unsigned int> offsets = {0};
+  vector<float> content;
+  for (size_t iev = 0; iev < num_events; iev++) {
+    const unsigned int n = length(rng);
+    for (unsigned int i = 0; i < n; i++) {
+      content.push_back(uniform(rng) < 0.05f ? NAN : 10.0f * uniform(rng) - 5.0f);
+    }
+    offsets.push_back(content.size());
+  }
+  vector<float> mx(num_events), mx_ref(num_events);
+  vector<int> imx(num_events), imx_ref(num_events);
+  simd::segmented_max(content.data(), offsets.data(), num_events, mx.data(), -1.0f);
+  simd::segmented_argmax(content.data(), offsets.data(), num_events, imx.data());
+  simd::scalar::segmented_max(content.data(), offsets.data(), num_events, mx_ref.data(), -1.0f);
+  simd::scalar::segmented_argmax(content.data(), offsets.data(), num_events, imx_ref.data());
+  size_t ret = 0;
+  for (size_t iev = 0; iev < num_events; iev++) {
+    if (ulp_distance(mx[iev], mx_ref[iev]) != 0 || imx[iev] != imx_ref[iev]) {
+      ret += 1;
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  const size_t num_values = argc > 1 ? atol(argv[1]) : 1000000;
+  const int num_repeats = argc > 2 ? atoi(argv[2]) : 20;
+
+  // NanoAOD-like kinematics: most objects are central, some are forward jets
+  mt19937 rng(12345);
+  uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  exponential_distribution<float> falling(1.0f / 30.0f);
+  vector<float> pt(num_values), eta(num_values), phi(num_values), px(num_values),
+      py(num_values), p2(num_values);
+  for (size_t i = 0; i < num_values; i++) {
+    pt[i] = 15.0f + falling(rng);
+    const float sign = uniform(rng) < 0.5f ? -1.0f : 1.0f;
+    eta[i] = sign * (uniform(rng) < 0.7f ? 2.5f * uniform(rng) : 2.5f + 2.2f * uniform(rng));
+    phi[i] = static_cast<float>(M_PI) * (2.0f * uniform(rng) - 1.0f);
+    px[i] = pt[i] * std::cos(phi[i]);
+    py[i] = pt[i] * std::sin(phi[i]);
+    const float pz = pt[i] * std::sinh(eta[i]);
+    p2[i] = pt[i] * pt[i] + pz * pz;
+  }
+
+  // Values over the full range of the approximations
+  const size_t num_range = std::min(num_values, size_t(1000000));
+  Inputs angles, sinh_range, atan2_range, positive;
+  for (size_t i = 0; i < num_range; i++) {
+    angles.x.push_back(8192.0f * (2.0f * uniform(rng) - 1.0f));
+    sinh_range.x.push_back(89.0f * (2.0f * uniform(rng) - 1.0f));
+    // random magnitudes and signs
+    atan2_range.x.push_back(std::ldexp(2.0f * uniform(rng) - 1.0f, int(60 * uniform(rng)) - 30));
+    atan2_range.y.push_back(std::ldexp(2.0f * uniform(rng) - 1.0f, int(60 * uniform(rng)) - 30));
+    positive.x.push_back(std::ldexp(uniform(rng) + 0.5f, int(250 * uniform(rng)) - 125));
+  }
+
+  vector<Function> functions;
+  functions.push_back(Function{
+      "sin", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::sin(in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float) { return std::sin(double(x)); }, Inputs{phi, {}}, angles});
+  functions.push_back(Function{
+      "cos", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::cos(in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float) { return std::cos(double(x)); }, Inputs{phi, {}}, angles});
+  functions.push_back(Function{
+      "sinh", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::sinh(in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float) { return std::sinh(double(x)); }, Inputs{eta, {}}, sinh_range});
+  functions.push_back(Function{
+      "atan2", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::atan2(in.y.data(), in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float y) { return std::atan2(double(y), double(x)); }, Inputs{px, py},
+      atan2_range});
+  functions.push_back(Function{
+      "sqrt", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::sqrt(in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float) { return std::sqrt(double(x)); }, Inputs{p2, {}}, positive});
+  functions.push_back(Function{
+      "log", [](const Inputs& in, float* out, simd::MathMode mode) {
+        simd::log(in.x.data(), in.x.size(), out, mode);
+      },
+      [](float x, float) { return std::log(double(x)); }, Inputs{pt, {}}, positive});
+
+  vector<simd::ISA> isas = {simd::ISA::Scalar};
+  if (static_cast<int>(simd::detect_isa()) >= static_cast<int>(simd::ISA::AVX2)) {
+    isas.push_back(simd::ISA::AVX2);
+  }
+  if (simd::detect_isa() == simd::ISA::AVX512) {
+    isas.push_back(simd::ISA::AVX512);
+  }
+
+  printf("%zu values, best of %d repeats\n", num_values, num_repeats);
+  printf("%-8s %-8s %12s %10s %14s %16s\n", "function", "mode", "ns/value", "speedup",
+         "max ULP (nano)", "max ULP (range)");
+  for (const auto& f : functions) {
+    const double t_libm = time_per_value(f, f.nanoaod, simd::MathMode::Exact, num_repeats);
+    printf("%-8s %-8s %12.3f %10.2f %14lld %16lld\n", f.name.c_str(), "libm", t_libm, 1.0,
+           (long long)max_ulp(f, f.nanoaod, simd::MathMode::Exact),
+           (long long)max_ulp(f, f.full_range, simd::MathMode::Exact));
+    for (const auto isa : isas) {
+      simd::set_isa(isa);
+      const double t = time_per_value(f, f.nanoaod, simd::MathMode::Fast, num_repeats);
+      printf("%-8s %-8s %12.3f %10.2f %14lld %16lld\n", f.name.c_str(), simd::isa_name(isa), t,
+             t_libm / t, (long long)max_ulp(f, f.nanoaod, simd::MathMode::Fast),
+             (long long)max_ulp(f, f.full_range, simd::MathMode::Fast));
+    }
+  }
+
+  size_t num_mismatches = 0;
+  for (const auto isa : isas) {
+    simd::set_isa(isa);
+    const size_t n = segmented_mismatches(rng);
+    printf("segmented max/argmax %-8s events differing from scalar with NaNs: %zu\n",
+           simd::isa_name(isa), n);
+    num_mismatches += n;
+  }
+  simd::set_isa(simd::detect_isa());
+
+  return num_mismatches > 0 ? 1 : 0;
+}